@@ -0,0 +1,83 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Prints the telemetry of a unit as b3603d publishes it, as CSV of
+ * "<seq>,<time>,<V>,<A>,<status>,<round msec>" with empty fields for readings
+ * that failed. An example of a reader, it polls the ring and never makes a
+ * system call for it.
+ */
+
+#include "telemetry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+	b3603_reader_t r;
+	b3603_sample_t s;
+	char name[128];
+	long count = -1;
+	uint64_t lost = 0;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <unit> [count]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 3)
+		count = atol(argv[2]);
+
+	snprintf(name, sizeof(name), "/b3603.%s", argv[1]);
+	if (b3603_ring_attach(&r, name) < 0) {
+		perror(name);
+		return 2;
+	}
+
+	while (count != 0) {
+		if (!b3603_ring_read(&r, &s)) {
+			usleep(1000);
+			continue;
+		}
+
+		if (r.lost != lost) {
+			fprintf(stderr, "%llu records lost\n", (unsigned long long)(r.lost - lost));
+			lost = r.lost;
+		}
+
+		printf("%llu,%llu.%06llu,", (unsigned long long)s.seq,
+			(unsigned long long)(s.time_us / 1000000), (unsigned long long)(s.time_us % 1000000));
+		if (s.valid & B3603_SAMPLE_VOUT)
+			printf("%u.%03u", s.vout_mv / 1000, s.vout_mv % 1000);
+		putchar(',');
+		if (s.valid & B3603_SAMPLE_IOUT)
+			printf("%u.%03u", s.iout_ma / 1000, s.iout_ma % 1000);
+		putchar(',');
+		if (s.valid & B3603_SAMPLE_STATUS)
+			printf("%u", s.status);
+		printf(",%.3f\n", s.round_us / 1000.0);
+		fflush(stdout);
+
+		if (count > 0)
+			count--;
+	}
+
+	b3603_ring_detach(&r);
+	return 0;
+}
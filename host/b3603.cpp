@@ -0,0 +1,551 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "b3603.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace b3603 {
+
+const char *result_str(Result r)
+{
+	switch (r) {
+		case OK: return "ok";
+		case TIMEOUT: return "timeout";
+		case CLOSED: return "closed";
+		case GARBLED: return "garbled";
+	}
+	return "?";
+}
+
+static speed_t baud_speed(unsigned baud)
+{
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 921600: return B921600;
+	}
+	return B0;
+}
+
+/* Unit */
+
+Unit::Unit(Loop &loop, const std::string &path, unsigned baud)
+	: window(8), timeout(200), gap(20), loop(loop), port(path), baud(baud),
+	  fd(-1), want_out(false), resync(false), last_in(0)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+Unit::~Unit()
+{
+	close();
+}
+
+bool Unit::open()
+{
+	struct termios tio;
+	speed_t speed = baud_speed(baud);
+
+	if (fd >= 0)
+		return true;
+	if (speed == B0) {
+		errno = EINVAL;
+		return false;
+	}
+
+	fd = ::open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (tcgetattr(fd, &tio) < 0)
+		goto fail;
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(fd, TCSANOW, &tio) < 0)
+		goto fail;
+
+	// Whatever the unit said before we got here, e.g. the boot banner, is noise
+	tcflush(fd, TCIOFLUSH);
+
+	loop.add(this);
+	return true;
+
+fail:
+	int err = errno;
+	::close(fd);
+	fd = -1;
+	errno = err;
+	return false;
+}
+
+void Unit::close()
+{
+	if (fd < 0)
+		return;
+
+	loop.remove(this);
+	::close(fd);
+	fd = -1;
+	out.clear();
+	in.clear();
+	want_out = false;
+	resync = false;
+
+	fail_wire(CLOSED);
+	while (!queued.empty()) {
+		Request req = std::move(queued.front());
+		queued.pop_front();
+		stats.requests++;
+		if (req.done)
+			req.done(CLOSED, std::string());
+	}
+}
+
+static Answer done_answer(Done done)
+{
+	if (!done)
+		return Answer();
+	return [done](Result r, const std::string &) { done(r); };
+}
+
+static Answer reading_answer(Reading done)
+{
+	return [done](Result r, const std::string &text) {
+		done(r, r == OK ? strtod(text.c_str(), NULL) : 0.0);
+	};
+}
+
+void Unit::set_voltage(double volt, Done done)
+{
+	char cmd[32];
+
+	// Two decimals, the parser takes the command as complete after them
+	snprintf(cmd, sizeof(cmd), "VSET1:%.2f", volt);
+	submit(cmd, NONE, done_answer(done));
+}
+
+void Unit::set_current(double amp, Done done)
+{
+	char cmd[32];
+
+	snprintf(cmd, sizeof(cmd), "ISET1:%.3f", amp);
+	submit(cmd, NONE, done_answer(done));
+}
+
+void Unit::set_output(bool on, Done done)
+{
+	submit(on ? "OUT1" : "OUT0", NONE, done_answer(done));
+}
+
+void Unit::send(const std::string &cmd, Done done)
+{
+	submit(cmd, NONE, done_answer(done));
+}
+
+void Unit::voltage(Reading done)
+{
+	submit("VOUT1?", MILLI, reading_answer(done));
+}
+
+void Unit::current(Reading done)
+{
+	submit("IOUT1?", MILLI, reading_answer(done));
+}
+
+void Unit::voltage_set(Reading done)
+{
+	submit("VSET1?", MILLI, reading_answer(done));
+}
+
+void Unit::current_set(Reading done)
+{
+	submit("ISET1?", MILLI, reading_answer(done));
+}
+
+void Unit::status(StatusReading done)
+{
+	submit("STATUS?", BYTE, [done](Result r, const std::string &text) {
+		Status st;
+
+		st.raw = (r == OK) ? (uint8_t)text[0] : 0;
+		done(r, st);
+	});
+}
+
+void Unit::query(const std::string &cmd, Answer done)
+{
+	Framing framing = GAP;
+
+	if (cmd == "STATUS?")
+		framing = BYTE;
+	else if (cmd == "VOUT1?" || cmd == "IOUT1?" || cmd == "VSET1?" || cmd == "ISET1?")
+		framing = MILLI;
+
+	submit(cmd, framing, done);
+}
+
+void Unit::submit(const std::string &cmd, Framing framing, Answer done)
+{
+	Request req;
+
+	req.cmd = cmd;
+	req.framing = framing;
+	req.done = done;
+	req.sent = 0;
+
+	if (fd < 0) {
+		stats.requests++;
+		if (done)
+			done(CLOSED, std::string());
+		return;
+	}
+
+	queued.push_back(std::move(req));
+	fill();
+}
+
+/* Moves requests from the queue to the wire as far as the window and the
+ * framing allow. A request without an answer is done as soon as it is handed
+ * to the port, the unit handles commands in order so whatever is queued after
+ * it sees its effect.
+ */
+void Unit::fill()
+{
+	uint64_t now = Loop::now();
+
+	while (fd >= 0 && !resync && !queued.empty()) {
+		Request &req = queued.front();
+
+		if (!wire.empty() && (wire.back().framing == GAP || req.framing == GAP))
+			break;
+		if (req.framing != NONE && wire.size() >= window)
+			break;
+
+		out += req.cmd;
+		stats.bytes_out += req.cmd.size();
+		req.sent = now;
+
+		if (req.framing == NONE) {
+			Request done = std::move(req);
+
+			queued.pop_front();
+			stats.requests++;
+			if (done.done)
+				done.done(OK, std::string());
+			continue;
+		}
+
+		wire.push_back(std::move(req));
+		queued.pop_front();
+	}
+
+	flush();
+}
+
+void Unit::flush()
+{
+	while (fd >= 0 && !out.empty()) {
+		ssize_t n = write(fd, out.data(), out.size());
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				close();
+				return;
+			}
+			break;
+		}
+		out.erase(0, n);
+	}
+
+	if (fd >= 0 && want_out != !out.empty()) {
+		want_out = !out.empty();
+		loop.update(this);
+	}
+}
+
+void Unit::writable()
+{
+	flush();
+}
+
+void Unit::ready(uint32_t events)
+{
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		readable(Loop::now());
+	if ((events & EPOLLOUT) && fd >= 0)
+		writable();
+}
+
+// Completes the oldest request on the wire with what was received for it
+void Unit::complete(Result r)
+{
+	Request req = std::move(wire.front());
+	std::string text;
+
+	wire.pop_front();
+	text.swap(in);
+
+	stats.requests++;
+	if (r == OK) {
+		uint64_t lat = Loop::now() - req.sent;
+
+		stats.answered++;
+		stats.latency_us += lat;
+		if (lat > stats.latency_max_us)
+			stats.latency_max_us = lat;
+	}
+
+	if (req.done)
+		req.done(r, text);
+}
+
+void Unit::fail_wire(Result r)
+{
+	while (!wire.empty())
+		complete(r);
+}
+
+// The framing is lost, drop the pipeline and wait for the line to go quiet
+void Unit::lost(Result r)
+{
+	if (r == TIMEOUT)
+		stats.timeouts++;
+	else
+		stats.garbled++;
+
+	fail_wire(r);
+	resync = true;
+	last_in = Loop::now();
+}
+
+void Unit::readable(uint64_t now)
+{
+	char buf[256];
+	ssize_t n;
+
+	while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			close(); // EIO when the other end of a pty went away
+			return;
+		}
+
+		stats.bytes_in += n;
+		last_in = now;
+
+		for (ssize_t i = 0; i < n; i++) {
+			char ch = buf[i];
+
+			if (resync || wire.empty()) {
+				stats.stray++;
+				continue;
+			}
+
+			in += ch;
+			switch (wire.front().framing) {
+				case BYTE:
+					complete(OK);
+					break;
+				case MILLI: {
+					size_t dot = in.find('.');
+
+					if (ch != '.' && (ch < '0' || ch > '9'))
+						lost(GARBLED);
+					else if (dot != std::string::npos && ch == '.' && dot != in.size() - 1)
+						lost(GARBLED);
+					else if (dot != std::string::npos && in.size() - dot == 4)
+						complete(OK);
+					break;
+				}
+				default: // GAP, NONE never gets here
+					break;
+			}
+		}
+	}
+
+	fill();
+}
+
+uint64_t Unit::deadline() const
+{
+	if (resync)
+		return last_in + gap * 1000ULL;
+	if (wire.empty())
+		return 0;
+
+	const Request &req = wire.front();
+	uint64_t end = req.sent + timeout * 1000ULL;
+
+	if (req.framing == GAP && !in.empty() && last_in + gap * 1000ULL < end)
+		end = last_in + gap * 1000ULL;
+
+	return end;
+}
+
+void Unit::expire(uint64_t now)
+{
+	uint64_t end = deadline();
+
+	if (!end || now < end)
+		return;
+
+	if (resync) {
+		resync = false;
+		in.clear();
+	} else if (wire.front().framing == GAP && !in.empty()) {
+		complete(OK);
+	} else {
+		lost(TIMEOUT);
+		return;
+	}
+
+	fill();
+}
+
+/* Loop */
+
+Loop::Loop()
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+Loop::~Loop()
+{
+	while (!units.empty())
+		units.back()->close();
+	::close(epfd);
+}
+
+uint64_t Loop::now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void Loop::watch(int fd, uint32_t events, Watcher *w)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void Loop::unwatch(int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void Loop::add(Unit *u)
+{
+	watch(u->fd, EPOLLIN, u);
+	units.push_back(u);
+}
+
+void Loop::remove(Unit *u)
+{
+	unwatch(u->fd);
+	for (size_t i = 0; i < units.size(); i++) {
+		if (units[i] == u) {
+			units[i] = units.back();
+			units.pop_back();
+			break;
+		}
+	}
+}
+
+void Loop::update(Unit *u)
+{
+	watch(u->fd, u->want_out ? EPOLLIN | EPOLLOUT : EPOLLIN, u);
+}
+
+/* Deadlines are found by walking the units, which is cheap next to the system
+ * call for the few dozen ports a host serves.
+ */
+int Loop::run(int max_ms)
+{
+	struct epoll_event evs[64];
+	uint64_t now = Loop::now();
+	int wait = max_ms;
+	int n;
+
+	for (size_t i = 0; i < units.size(); i++) {
+		uint64_t end = units[i]->deadline();
+		int ms;
+
+		if (!end)
+			continue;
+		ms = end > now ? (end - now + 999) / 1000 : 0;
+		if (wait < 0 || ms < wait)
+			wait = ms;
+	}
+
+	n = epoll_wait(epfd, evs, 64, wait);
+	if (n < 0)
+		n = 0;
+
+	for (int i = 0; i < n; i++)
+		((Watcher *)evs[i].data.ptr)->ready(evs[i].events);
+
+	now = Loop::now();
+
+	// Units may close from a callback, walk by index
+	for (size_t i = 0; i < units.size(); i++)
+		units[i]->expire(now);
+
+	return n;
+}
+
+void Loop::drain()
+{
+	for (;;) {
+		bool busy = false;
+
+		for (size_t i = 0; i < units.size(); i++)
+			busy |= units[i]->pending() > 0;
+		if (!busy)
+			break;
+		run();
+	}
+}
+
+}
@@ -0,0 +1,208 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef B3603_H
+#define B3603_H
+
+/* Host side client for the Korad command set of the B3603 firmware, see
+ * stm8/PROTOCOL.md.
+ *
+ * One Loop serves any number of Units, each an open serial port, from a single
+ * epoll set and never blocks. Every command is queued on its unit and the
+ * result is handed to a callback from Loop::run(), or right away when the port
+ * is not open. Callbacks may queue more commands or close a unit but must not
+ * destroy one.
+ *
+ * The Korad commands have no terminator and most have no answer, so replies
+ * are matched to requests by order and framed by their format: STATUS? answers
+ * a single byte and the V and I queries "<V>.<mmm>". Those are pipelined, up to
+ * Unit::window requests are on the wire at once. Any other query is answered
+ * in a format the client cannot delimit, it is sent on its own once the
+ * pipeline is empty and its answer ends when the line has been quiet for
+ * Unit::gap. A request that is not answered within Unit::timeout fails, and
+ * since the framing of what follows is then lost the whole pipeline fails with
+ * it and the unit waits for the line to go quiet before it sends again.
+ */
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace b3603 {
+
+enum Result {
+	OK,
+	TIMEOUT, // No complete answer in time
+	CLOSED, // The port was closed or failed with the request queued
+	GARBLED, // The answer did not have the expected format
+};
+
+const char *result_str(Result r);
+
+// STATUS? byte
+struct Status {
+	uint8_t raw;
+
+	bool cv() const { return raw & 1; }
+	bool ocp() const { return raw & 32; }
+	bool output() const { return raw & 64; }
+};
+
+typedef std::function<void(Result)> Done;
+typedef std::function<void(Result, double)> Reading;
+typedef std::function<void(Result, Status)> StatusReading;
+typedef std::function<void(Result, const std::string &)> Answer;
+
+class Loop;
+
+// Anything else the loop should wait on, e.g. a listening socket
+class Watcher {
+public:
+	virtual ~Watcher() {}
+	virtual void ready(uint32_t events) = 0; // EPOLLIN etc.
+};
+
+struct UnitStats {
+	uint64_t requests; // Completed, whatever the result
+	uint64_t timeouts;
+	uint64_t garbled;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t stray; // Received with nothing to answer
+	uint64_t latency_us; // Sum over the answered requests, from the write
+	uint64_t answered;
+	uint32_t latency_max_us;
+};
+
+class Unit : private Watcher {
+public:
+	Unit(Loop &loop, const std::string &path, unsigned baud = 38400);
+	~Unit();
+
+	// Returns false and leaves errno set when the port could not be set up
+	bool open();
+	void close();
+	bool is_open() const { return fd >= 0; }
+	const std::string &path() const { return port; }
+
+	// Settings, no answer
+	void set_voltage(double volt, Done done = Done());
+	void set_current(double amp, Done done = Done());
+	void set_output(bool on, Done done = Done());
+	void send(const std::string &cmd, Done done = Done());
+
+	// Pipelined queries
+	void voltage(Reading done); // VOUT1?
+	void current(Reading done); // IOUT1?
+	void voltage_set(Reading done); // VSET1?
+	void current_set(Reading done); // ISET1?
+	void status(StatusReading done); // STATUS?
+
+	/* Any query as text, e.g. "ENERGY?". The ones above are framed and
+	 * pipelined as usual, STATUS? answers the raw byte. Anything else is
+	 * framed by the quiet gap.
+	 */
+	void query(const std::string &cmd, Answer done);
+
+	size_t pending() const { return queued.size() + wire.size(); }
+
+	unsigned window; // Requests on the wire at once, default 8
+	unsigned timeout; // msec from the write to the end of the answer, default 200
+	unsigned gap; // msec of quiet that ends an unframed answer, default 20
+	UnitStats stats;
+
+private:
+	friend class Loop;
+
+	enum Framing {
+		NONE, // No answer
+		BYTE, // One byte
+		MILLI, // "<V>.<mmm>"
+		GAP, // Until the line is quiet
+	};
+
+	struct Request {
+		std::string cmd;
+		Framing framing;
+		Answer done;
+		uint64_t sent; // usec
+	};
+
+	void submit(const std::string &cmd, Framing framing, Answer done);
+	void fill();
+	void flush();
+	void ready(uint32_t events);
+	void readable(uint64_t now);
+	void writable();
+	void expire(uint64_t now);
+	uint64_t deadline() const;
+	void complete(Result r);
+	void fail_wire(Result r);
+	void lost(Result r);
+
+	Loop &loop;
+	std::string port;
+	unsigned baud;
+	int fd;
+	bool want_out;
+	bool resync; // Waiting for the line to go quiet after a timeout
+	uint64_t last_in; // usec
+
+	std::deque<Request> queued; // Not written yet
+	std::deque<Request> wire; // Written, oldest first
+	std::string out;
+	std::string in; // Answer to wire.front() so far
+};
+
+class Loop {
+public:
+	Loop();
+	~Loop();
+
+	/* Waits for I/O or the next request deadline and completes whatever is
+	 * due, for at most max_ms (-1 waits for the next event). Returns the number
+	 * of units that did something.
+	 */
+	int run(int max_ms = -1);
+
+	// Runs until no unit has anything pending
+	void drain();
+
+	// The watcher must stay around until unwatch()
+	void watch(int fd, uint32_t events, Watcher *w);
+	void unwatch(int fd);
+
+	static uint64_t now(); // usec, monotonic
+
+private:
+	friend class Unit;
+
+	void add(Unit *u);
+	void remove(Unit *u);
+	void update(Unit *u);
+
+	int epfd;
+	std::vector<Unit *> units;
+};
+
+}
+
+#endif
@@ -0,0 +1,533 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fleet daemon, owns the serial ports of many units so that nothing else has
+ * to open them.
+ *
+ * Every unit is polled for VOUT1?, IOUT1? and STATUS? at the configured rate,
+ * or back to back with -r 0, and each round goes into the unit's telemetry
+ * ring, see telemetry.h. A round that is still running when the next one is
+ * due is not doubled up, the skipped round is counted as an overrun.
+ *
+ * Commands go through a Unix stream socket, one per line, answered in order
+ * with a line starting with OK or ERR:
+ *
+ *   LIST                 "<unit> <port> <ring> open|closed" per unit
+ *   STATS                counters per unit and the daemon's CPU use
+ *   <unit> <command>     any Korad command, a query answers "OK <answer>"
+ *
+ * where <unit> is the basename of the port, e.g. ttyUSB0.
+ */
+
+#include "b3603.h"
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+
+using namespace b3603;
+
+#define REOPEN_US 1000000 // Retry a port that failed every second
+
+static volatile sig_atomic_t stop;
+
+static uint64_t realtime_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Units */
+
+struct Member {
+	std::unique_ptr<Unit> unit;
+	std::string name;
+	std::string shm;
+	b3603_ring_t *ring;
+	size_t ring_size;
+
+	b3603_sample_t sample;
+	unsigned outstanding; // Readings still to come in this round
+	uint64_t started; // Monotonic usec
+	uint64_t reopen;
+
+	uint64_t rounds;
+	uint64_t overruns;
+};
+
+static std::vector<std::unique_ptr<Member> > members;
+static bool back_to_back;
+
+static bool ring_create(Member *m, uint32_t capacity, uint32_t rate_mhz)
+{
+	int fd;
+
+	shm_unlink(m->shm.c_str()); // Readers of an old ring keep their copy
+	fd = shm_open(m->shm.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return false;
+
+	m->ring_size = b3603_ring_size(capacity);
+	if (ftruncate(fd, m->ring_size) < 0) {
+		close(fd);
+		return false;
+	}
+	m->ring = (b3603_ring_t *)mmap(NULL, m->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->ring == MAP_FAILED)
+		return false;
+
+	m->ring->capacity = capacity;
+	m->ring->rate_mhz = rate_mhz;
+	m->ring->sample_size = sizeof(b3603_sample_t);
+	m->ring->version = B3603_RING_VERSION;
+	snprintf(m->ring->port, sizeof(m->ring->port), "%s", m->unit->path().c_str());
+	__atomic_store_n(&m->ring->magic, B3603_RING_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void round_start(Member *m);
+
+static void reading_done(Member *m)
+{
+	if (--m->outstanding)
+		return;
+
+	m->sample.round_us = Loop::now() - m->started;
+	b3603_ring_write(m->ring, &m->sample);
+	m->rounds++;
+
+	// A closed port is reopened from the main loop
+	if (back_to_back && m->unit->is_open())
+		round_start(m);
+}
+
+static void round_start(Member *m)
+{
+	if (m->outstanding) {
+		m->overruns++;
+		return;
+	}
+	if (!m->unit->is_open()) {
+		uint64_t now = Loop::now();
+
+		if (now < m->reopen)
+			return;
+		m->reopen = now + REOPEN_US;
+		if (!m->unit->open())
+			return;
+	}
+
+	memset(&m->sample, 0, sizeof(m->sample));
+	m->sample.time_us = realtime_us();
+	m->started = Loop::now();
+	m->outstanding = 3;
+
+	m->unit->voltage([m](Result r, double v) {
+		if (r == OK) {
+			m->sample.vout_mv = v * 1000 + 0.5;
+			m->sample.valid |= B3603_SAMPLE_VOUT;
+		}
+		reading_done(m);
+	});
+	m->unit->current([m](Result r, double v) {
+		if (r == OK) {
+			m->sample.iout_ma = v * 1000 + 0.5;
+			m->sample.valid |= B3603_SAMPLE_IOUT;
+		}
+		reading_done(m);
+	});
+	m->unit->status([m](Result r, Status st) {
+		if (r == OK) {
+			m->sample.status = st.raw;
+			m->sample.valid |= B3603_SAMPLE_STATUS;
+		}
+		reading_done(m);
+	});
+}
+
+static Member *find_member(const std::string &name)
+{
+	for (size_t i = 0; i < members.size(); i++)
+		if (members[i]->name == name)
+			return members[i].get();
+	return NULL;
+}
+
+/* Control socket */
+
+struct Client : public Watcher, public std::enable_shared_from_this<Client> {
+	Loop &loop;
+	int fd;
+	std::string in;
+	std::string out;
+	std::deque<std::pair<bool, std::string> > replies; // Done, text
+	std::shared_ptr<Client> self; // Keeps it alive while connected
+
+	Client(Loop &loop, int fd) : loop(loop), fd(fd) {}
+
+	void ready(uint32_t events);
+	void command(const std::string &line);
+	void reply(size_t slot, const std::string &text);
+	void flush();
+	void hangup();
+
+	size_t slot()
+	{
+		replies.push_back(std::make_pair(false, std::string()));
+		return replies.size() - 1 + done_before;
+	}
+
+	uint64_t done_before = 0; // Replies already sent
+};
+
+void Client::hangup()
+{
+	if (fd < 0)
+		return;
+	loop.unwatch(fd);
+	close(fd);
+	fd = -1;
+	self.reset(); // Callbacks still pending hold their own reference
+}
+
+void Client::reply(size_t slot, const std::string &text)
+{
+	replies[slot - done_before] = std::make_pair(true, text);
+	while (!replies.empty() && replies.front().first) {
+		out += replies.front().second;
+		out += '\n';
+		replies.pop_front();
+		done_before++;
+	}
+	flush();
+}
+
+void Client::flush()
+{
+	while (fd >= 0 && !out.empty()) {
+		ssize_t n = write(fd, out.data(), out.size());
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				hangup();
+			break;
+		}
+		out.erase(0, n);
+	}
+	if (fd >= 0)
+		loop.watch(fd, out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT, this);
+}
+
+void Client::command(const std::string &line)
+{
+	size_t slot = this->slot();
+	size_t space = line.find(' ');
+	std::shared_ptr<Client> me = shared_from_this();
+
+	if (line == "LIST") {
+		std::string text;
+
+		for (size_t i = 0; i < members.size(); i++) {
+			Member *m = members[i].get();
+
+			text += m->name + " " + m->unit->path() + " " + m->shm +
+				(m->unit->is_open() ? " open\n" : " closed\n");
+		}
+		reply(slot, text + "OK");
+		return;
+	}
+
+	if (line == "STATS") {
+		static uint64_t last_cpu, last_time;
+		uint64_t cpu = cpu_us(), now = Loop::now();
+		std::string text;
+		char buf[256];
+
+		for (size_t i = 0; i < members.size(); i++) {
+			Member *m = members[i].get();
+			const UnitStats &st = m->unit->stats;
+
+			snprintf(buf, sizeof(buf), "%s rounds=%llu overruns=%llu requests=%llu timeouts=%llu garbled=%llu latency_avg_us=%llu\n",
+				m->name.c_str(), (unsigned long long)m->rounds, (unsigned long long)m->overruns,
+				(unsigned long long)st.requests, (unsigned long long)st.timeouts,
+				(unsigned long long)st.garbled,
+				(unsigned long long)(st.answered ? st.latency_us / st.answered : 0));
+			text += buf;
+		}
+		// CPU use since the last STATS
+		snprintf(buf, sizeof(buf), "OK cpu=%.1f%%", last_time && now > last_time ?
+			(cpu - last_cpu) * 100.0 / (now - last_time) : 0.0);
+		last_cpu = cpu;
+		last_time = now;
+		reply(slot, text + buf);
+		return;
+	}
+
+	Member *m = space == std::string::npos ? NULL : find_member(line.substr(0, space));
+	if (!m) {
+		reply(slot, "ERR no such unit");
+		return;
+	}
+
+	std::string cmd = line.substr(space + 1);
+	if (cmd.find('?') == std::string::npos) {
+		m->unit->send(cmd, [me, slot](Result r) {
+			me->reply(slot, r == OK ? "OK" : std::string("ERR ") + result_str(r));
+		});
+	} else if (cmd == "STATUS?") {
+		m->unit->status([me, slot](Result r, Status st) {
+			me->reply(slot, r == OK ? "OK " + std::to_string(st.raw) : std::string("ERR ") + result_str(r));
+		});
+	} else {
+		m->unit->query(cmd, [me, slot](Result r, const std::string &text) {
+			me->reply(slot, r == OK ? "OK " + text : std::string("ERR ") + result_str(r));
+		});
+	}
+}
+
+void Client::ready(uint32_t events)
+{
+	std::shared_ptr<Client> keep = shared_from_this(); // hangup() drops self
+	char buf[512];
+	ssize_t n = -1;
+
+	if (events & EPOLLOUT)
+		flush();
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+		size_t nl;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				hangup();
+			return;
+		}
+
+		in.append(buf, n);
+		while ((nl = in.find('\n')) != std::string::npos) {
+			std::string line = in.substr(0, nl);
+
+			in.erase(0, nl + 1);
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			if (!line.empty())
+				command(line);
+		}
+		if (in.size() > 1024)
+			hangup(); // Nobody sends lines that long
+	}
+	if (n == 0)
+		hangup();
+}
+
+struct Server : public Watcher {
+	Loop &loop;
+	int fd;
+
+	Server(Loop &loop, int fd) : loop(loop), fd(fd) {}
+
+	void ready(uint32_t events)
+	{
+		int conn;
+
+		while ((conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+			std::shared_ptr<Client> c = std::make_shared<Client>(loop, conn);
+
+			c->self = c;
+			loop.watch(conn, EPOLLIN, c.get());
+		}
+	}
+};
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Main */
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] port...\n"
+		"  -r <Hz>      Rounds per second per unit, 0 for back to back, default 10\n"
+		"  -s <path>    Control socket, default /tmp/b3603d.sock\n"
+		"  -n <count>   Records per ring, a power of two, default 4096\n"
+		"  -b <baud>    Baud rate, default 38400\n"
+		"  -w <window>  Requests in flight per unit, default 8\n"
+		"  -S <sec>     Print rounds per second and CPU use to stderr\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	double rate = 10;
+	const char *sock_path = "/tmp/b3603d.sock";
+	unsigned capacity = 4096, baud = 38400, window = 8, stats_every = 0;
+	uint64_t period, next_round, next_stats, last_cpu, last_rounds = 0;
+	Loop loop;
+	int opt, sock;
+
+	while ((opt = getopt(argc, argv, "r:s:n:b:w:S:")) != -1) {
+		switch (opt) {
+			case 'r': rate = atof(optarg); break;
+			case 's': sock_path = optarg; break;
+			case 'n': capacity = atoi(optarg); break;
+			case 'b': baud = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 'S': stats_every = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind == argc || capacity == 0 || (capacity & (capacity - 1)) || rate < 0)
+		usage(argv[0]);
+
+	back_to_back = rate == 0;
+	period = back_to_back ? 0 : 1000000 / rate;
+
+	for (int i = optind; i < argc; i++) {
+		std::unique_ptr<Member> m(new Member());
+		std::string port = argv[i];
+
+		m->unit.reset(new Unit(loop, port, baud));
+		m->unit->window = window;
+		m->name = basename(&port[0]);
+		m->shm = "/b3603." + m->name;
+		if (find_member(m->name)) {
+			fprintf(stderr, "%s: more than one port named %s\n", argv[i], m->name.c_str());
+			return 1;
+		}
+		if (!ring_create(m.get(), capacity, rate * 1000)) {
+			fprintf(stderr, "%s: %s\n", m->shm.c_str(), strerror(errno));
+			return 2;
+		}
+		if (!m->unit->open())
+			fprintf(stderr, "%s: %s, retrying\n", argv[i], strerror(errno));
+		m->reopen = Loop::now() + REOPEN_US;
+		members.push_back(std::move(m));
+	}
+
+	sock = listen_unix(sock_path);
+	if (sock < 0) {
+		fprintf(stderr, "%s: %s\n", sock_path, strerror(errno));
+		return 2;
+	}
+	Server server(loop, sock);
+	loop.watch(sock, EPOLLIN, &server);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	next_round = Loop::now();
+	next_stats = next_round + stats_every * 1000000ULL;
+	last_cpu = cpu_us();
+	while (!stop) {
+		uint64_t now = Loop::now();
+		uint64_t wake = back_to_back ? now + REOPEN_US : next_round;
+
+		if (stats_every && next_stats < wake)
+			wake = next_stats;
+		loop.run(wake > now ? (wake - now + 999) / 1000 : 0);
+
+		now = Loop::now();
+		if (now >= next_round) {
+			// Back to back rounds restart themselves, this only (re)starts idle units
+			for (size_t i = 0; i < members.size(); i++)
+				if (!back_to_back || !members[i]->outstanding)
+					round_start(members[i].get());
+			next_round = back_to_back ? now + REOPEN_US : next_round + period;
+			if (next_round < now)
+				next_round = now + period; // Fell behind, don't burst
+		}
+
+		if (stats_every && now >= next_stats) {
+			uint64_t rounds = 0, cpu = cpu_us();
+
+			for (size_t i = 0; i < members.size(); i++)
+				rounds += members[i]->rounds;
+			fprintf(stderr, "b3603d: %zu units, %.1f rounds/s, %.1f%% CPU\n", members.size(),
+				(rounds - last_rounds) / (double)stats_every,
+				(cpu - last_cpu) / (stats_every * 1e4));
+			last_rounds = rounds;
+			last_cpu = cpu;
+			next_stats = now + stats_every * 1000000ULL;
+		}
+	}
+
+	close(sock);
+	unlink(sock_path);
+	for (size_t i = 0; i < members.size(); i++) {
+		munmap(members[i]->ring, members[i]->ring_size);
+		shm_unlink(members[i]->shm.c_str());
+	}
+
+	return 0;
+}
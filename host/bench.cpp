@@ -0,0 +1,248 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the query rate and latency of the client against units, either
+ * ports given on the command line or b3603-sim instances it starts on ptys.
+ * Each unit keeps its pipeline full of VOUT1?, IOUT1? and STATUS? for the
+ * given time, first one request at a time and then with the full window, to
+ * show what pipelining buys on the same link.
+ */
+
+#include "b3603.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <memory>
+
+using namespace b3603;
+
+static std::vector<pid_t> sims;
+static std::vector<std::string> links;
+
+static void stop_sims(void)
+{
+	for (size_t i = 0; i < sims.size(); i++) {
+		kill(sims[i], SIGTERM);
+		waitpid(sims[i], NULL, 0);
+		unlink(links[i].c_str());
+	}
+	sims.clear();
+}
+
+static bool start_sim(const char *sim, const std::string &link)
+{
+	struct stat st;
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		freopen("/dev/null", "w", stderr);
+		execl(sim, sim, "-P", link.c_str(), (char *)NULL);
+		_exit(127);
+	}
+	sims.push_back(pid);
+	links.push_back(link);
+
+	// The link shows up once the pty is ready
+	for (int i = 0; i < 200; i++) {
+		if (lstat(link.c_str(), &st) == 0)
+			return true;
+		usleep(10000);
+	}
+	return false;
+}
+
+struct Driver {
+	Unit *unit;
+	uint64_t end;
+	unsigned next;
+	uint64_t errors;
+
+	void issue()
+	{
+		if (Loop::now() >= end || !unit->is_open())
+			return;
+
+		switch (next++ % 3) {
+			case 0:
+				unit->voltage([this](Result r, double) { done(r); });
+				break;
+			case 1:
+				unit->current([this](Result r, double) { done(r); });
+				break;
+			default:
+				unit->status([this](Result r, Status) { done(r); });
+				break;
+		}
+	}
+
+	void done(Result r)
+	{
+		if (r != OK)
+			errors++;
+		issue();
+	}
+};
+
+// User and system time of this process, the simulators are not counted
+static uint64_t cpu_usec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void idle(Loop &loop, unsigned ms)
+{
+	uint64_t end = Loop::now() + ms * 1000ULL;
+
+	while (Loop::now() < end)
+		loop.run((end - Loop::now()) / 1000 + 1);
+}
+
+static void run(Loop &loop, std::vector<std::unique_ptr<Unit> > &units, unsigned window, unsigned seconds)
+{
+	std::vector<Driver> drivers(units.size());
+	uint64_t start = Loop::now();
+	uint64_t cpu = cpu_usec();
+	uint64_t requests = 0, answered = 0, latency = 0, errors = 0;
+	uint32_t latency_max = 0;
+
+	for (size_t i = 0; i < units.size(); i++) {
+		Unit *u = units[i].get();
+
+		memset(&u->stats, 0, sizeof(u->stats));
+		u->window = window;
+		drivers[i].unit = u;
+		drivers[i].end = start + seconds * 1000000ULL;
+		drivers[i].next = 0;
+		drivers[i].errors = 0;
+		for (unsigned j = 0; j < window; j++)
+			drivers[i].issue();
+	}
+
+	loop.drain();
+
+	double elapsed = (Loop::now() - start) / 1e6;
+	double load = (cpu_usec() - cpu) / 1e4 / elapsed;
+
+	for (size_t i = 0; i < units.size(); i++) {
+		const UnitStats &st = units[i]->stats;
+
+		requests += st.requests;
+		answered += st.answered;
+		latency += st.latency_us;
+		errors += drivers[i].errors;
+		if (st.latency_max_us > latency_max)
+			latency_max = st.latency_max_us;
+	}
+
+	printf("window %2u: %zu units, %7.1f requests/s per unit, %8.1f total, latency avg %6.2f max %6.2f msec, %llu errors, %.1f%% CPU\n",
+		window, units.size(), requests / elapsed / units.size(), requests / elapsed,
+		answered ? latency / 1000.0 / answered : 0.0, latency_max / 1000.0,
+		(unsigned long long)errors, load);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [port...]\n"
+		"  -s <sim>     Start b3603-sim instances instead of opening ports\n"
+		"  -n <units>   Number of simulated units, default 1\n"
+		"  -w <window>  Pipeline window, default 8\n"
+		"  -t <sec>     Seconds per run, default 5\n"
+		"  -b <baud>    Baud rate, default 38400\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sim = NULL;
+	unsigned count = 1, window = 8, seconds = 5, baud = 38400;
+	std::vector<std::string> ports;
+	Loop loop;
+	std::vector<std::unique_ptr<Unit> > units;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:w:t:b:")) != -1) {
+		switch (opt) {
+			case 's': sim = optarg; break;
+			case 'n': count = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'b': baud = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	for (int i = optind; i < argc; i++)
+		ports.push_back(argv[i]);
+
+	if (sim) {
+		atexit(stop_sims);
+		for (unsigned i = 0; i < count; i++) {
+			char link[64];
+
+			snprintf(link, sizeof(link), "/tmp/b3603-bench.%d.%u", (int)getpid(), i);
+			if (!start_sim(sim, link)) {
+				fprintf(stderr, "%s did not come up\n", sim);
+				return 2;
+			}
+			ports.push_back(link);
+		}
+		if (baud != 38400)
+			fprintf(stderr, "-b only changes the host side, b3603-sim runs at 38400\n");
+	}
+	if (ports.empty())
+		usage(argv[0]);
+
+	for (size_t i = 0; i < ports.size(); i++) {
+		units.emplace_back(new Unit(loop, ports[i], baud));
+		if (!units.back()->open()) {
+			fprintf(stderr, "%s: %s\n", ports[i].c_str(), strerror(errno));
+			return 2;
+		}
+	}
+
+	// Let the firmware boot, its banner is dropped, then give it something to measure
+	idle(loop, 300);
+	for (size_t i = 0; i < units.size(); i++) {
+		units[i]->set_current(0.5);
+		units[i]->set_voltage(5.0);
+		units[i]->set_output(true);
+	}
+	idle(loop, 100);
+
+	run(loop, units, 1, seconds);
+	if (window > 1)
+		run(loop, units, window, seconds);
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/* Telemetry rings published by b3603d, one shared memory object per unit
+ * named "/b3603.<port basename>". Plain C so that any local program can read
+ * them. Readers map the ring read only and never make a system call after
+ * b3603_ring_attach().
+ *
+ * The daemon is the only writer. Every record carries the sequence number it
+ * was written with, plus one, and is zeroed while it is rewritten, so a reader
+ * that copies a record and finds the same number before and after has a
+ * consistent copy. A reader that falls a whole ring behind skips to the
+ * oldest record still there.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define B3603_RING_MAGIC 0x52363342 // "B36R"
+#define B3603_RING_VERSION 1
+
+#define B3603_SAMPLE_VOUT (1<<0) // vout is valid
+#define B3603_SAMPLE_IOUT (1<<1)
+#define B3603_SAMPLE_STATUS (1<<2)
+
+typedef struct {
+	uint64_t seq; // Sequence number + 1, 0 while being written
+	uint64_t time_us; // CLOCK_REALTIME
+	uint32_t vout_mv;
+	uint32_t iout_ma;
+	uint8_t status; // STATUS? byte
+	uint8_t valid; // B3603_SAMPLE_*
+	uint16_t reserved;
+	uint32_t round_us; // Time to get all three readings
+} b3603_sample_t;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sample_size;
+	uint32_t capacity; // Records, a power of two
+	uint32_t rate_mhz; // Sampling rate in mHz, 0 for as fast as the link goes
+	char port[48];
+	uint64_t head __attribute__((aligned(64))); // Records ever written
+	b3603_sample_t samples[] __attribute__((aligned(64)));
+} b3603_ring_t;
+
+static inline size_t b3603_ring_size(uint32_t capacity)
+{
+	return sizeof(b3603_ring_t) + capacity * sizeof(b3603_sample_t);
+}
+
+/* Writer side */
+
+static inline void b3603_ring_write(b3603_ring_t *ring, const b3603_sample_t *s)
+{
+	uint64_t seq = ring->head;
+	b3603_sample_t *rec = &ring->samples[seq & (ring->capacity - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)rec + sizeof(rec->seq), (const char *)s + sizeof(s->seq), sizeof(*s) - sizeof(s->seq));
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Reader side */
+
+typedef struct {
+	const b3603_ring_t *ring;
+	size_t size;
+	uint64_t next; // Sequence number of the next record to read
+	uint64_t lost; // Records overwritten before they were read
+} b3603_reader_t;
+
+// Returns 0, or -1 with errno set. Starts at the newest record.
+static inline int b3603_ring_attach(b3603_reader_t *r, const char *name)
+{
+	struct stat st;
+	void *p;
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(b3603_ring_t)) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	r->ring = (const b3603_ring_t *)p;
+	r->size = st.st_size;
+	r->lost = 0;
+	if (r->ring->magic != B3603_RING_MAGIC || r->ring->version != B3603_RING_VERSION ||
+			r->ring->sample_size != sizeof(b3603_sample_t) ||
+			b3603_ring_size(r->ring->capacity) > r->size) {
+		munmap(p, r->size);
+		return -1;
+	}
+
+	r->next = __atomic_load_n(&r->ring->head, __ATOMIC_ACQUIRE);
+	if (r->next)
+		r->next--;
+	return 0;
+}
+
+static inline void b3603_ring_detach(b3603_reader_t *r)
+{
+	munmap((void *)r->ring, r->size);
+	r->ring = NULL;
+}
+
+// Returns 1 with the next record in *s, 0 when there is nothing new
+static inline int b3603_ring_read(b3603_reader_t *r, b3603_sample_t *s)
+{
+	const b3603_ring_t *ring = r->ring;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		const b3603_sample_t *rec;
+		uint64_t seq;
+
+		if (r->next >= head)
+			return 0;
+		if (head - r->next > ring->capacity) {
+			r->lost += head - ring->capacity - r->next;
+			r->next = head - ring->capacity;
+		}
+
+		rec = &ring->samples[r->next & (ring->capacity - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		memcpy(s, rec, sizeof(*s));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == r->next + 1 && __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+			s->seq = seq - 1;
+			r->next++;
+			return 1;
+		}
+
+		// Overwritten under us, the writer is a lap ahead
+		r->lost++;
+		r->next++;
+	}
+}
+
+#endif
@@ -0,0 +1,197 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs the client against a pty with the test playing the unit on the other
+ * side, checking what goes on the wire and how answers are matched.
+ */
+
+#include "b3603.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace b3603;
+
+static int failures;
+
+#define CHECK(cond) if (!(cond)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; }
+
+static int dev; // Our end of the pty
+
+// Whatever the client wrote, the loop does not run meanwhile
+static std::string device_read(Loop &loop)
+{
+	struct pollfd pfd = { dev, POLLIN, 0 };
+	std::string s;
+	char buf[256];
+	ssize_t n;
+
+	loop.run(0);
+	while (poll(&pfd, 1, 2) > 0 && (n = read(dev, buf, sizeof(buf))) > 0)
+		s.append(buf, n);
+	return s;
+}
+
+static void device_write(const std::string &s)
+{
+	if (write(dev, s.data(), s.size()) != (ssize_t)s.size())
+		abort();
+}
+
+static void run_for(Loop &loop, unsigned ms)
+{
+	uint64_t end = Loop::now() + ms * 1000ULL;
+
+	while (Loop::now() < end)
+		loop.run(1);
+}
+
+static void run_until(Loop &loop, const std::function<bool()> &cond)
+{
+	uint64_t end = Loop::now() + 1000000;
+
+	while (!cond() && Loop::now() < end)
+		loop.run(1);
+}
+
+int main()
+{
+	Loop loop;
+	const char *name;
+	std::vector<std::string> order;
+	double vout = -1, iout = -1;
+	Status st = { 0 };
+	std::string text;
+	Result res = OK;
+
+	dev = posix_openpt(O_RDWR | O_NOCTTY);
+	if (dev < 0 || grantpt(dev) < 0 || unlockpt(dev) < 0 || !(name = ptsname(dev))) {
+		perror("pty");
+		return 2;
+	}
+	fcntl(dev, F_SETFL, fcntl(dev, F_GETFL) | O_NONBLOCK);
+
+	Unit unit(loop, name);
+	unit.timeout = 100;
+	unit.gap = 30;
+	CHECK(unit.open());
+
+	// Settings have no answer and are done once written
+	unit.set_voltage(1.5, [&](Result r) { order.push_back("vset"); res = r; });
+	unit.set_current(0.25);
+	CHECK(order.size() == 1 && res == OK);
+	CHECK(device_read(loop) == "VSET1:1.50ISET1:0.250");
+
+	// Queries are pipelined and matched in order, however the answers split
+	order.clear();
+	unit.voltage([&](Result r, double v) { order.push_back("v"); vout = v; });
+	unit.status([&](Result r, Status s) { order.push_back("s"); st = s; });
+	unit.current([&](Result r, double v) { order.push_back("i"); iout = v; });
+	CHECK(device_read(loop) == "VOUT1?STATUS?IOUT1?");
+	device_write("12.3");
+	run_for(loop, 5);
+	CHECK(order.empty());
+	device_write("45\x41" "0.0");
+	run_for(loop, 5);
+	device_write("10");
+	run_for(loop, 5);
+	CHECK(order.size() == 3 && order[0] == "v" && order[1] == "s" && order[2] == "i");
+	CHECK(vout == 12.345);
+	CHECK(st.cv() && !st.ocp() && st.output());
+	CHECK(iout == 0.010);
+	CHECK(unit.pending() == 0);
+
+	// The window caps what is on the wire
+	unit.window = 2;
+	for (int i = 0; i < 3; i++)
+		unit.voltage([&](Result r, double v) { vout = v; });
+	CHECK(device_read(loop) == "VOUT1?VOUT1?");
+	device_write("1.000");
+	run_for(loop, 5);
+	CHECK(device_read(loop) == "VOUT1?");
+	device_write("2.0003.000");
+	run_for(loop, 5);
+	CHECK(vout == 3.0 && unit.pending() == 0);
+	unit.window = 8;
+
+	// Queries by name are framed like the typed calls
+	order.clear();
+	unit.query("VOUT1?", [&](Result r, const std::string &s) { order.push_back(s); });
+	unit.query("STATUS?", [&](Result r, const std::string &s) { order.push_back(s); });
+	CHECK(device_read(loop) == "VOUT1?STATUS?");
+	device_write("4.200A");
+	run_for(loop, 5);
+	CHECK(order.size() == 2 && order[0] == "4.200" && order[1] == "A");
+
+	// Unframed queries go alone and end with the gap
+	unit.query("ENERGY?", [&](Result r, const std::string &s) { res = r; text = s; });
+	unit.voltage([&](Result r, double v) { vout = v; });
+	CHECK(device_read(loop) == "ENERGY?");
+	device_write("12,34,");
+	run_for(loop, 5);
+	CHECK(device_read(loop) == "");
+	device_write("56");
+	run_until(loop, [&]() { return !text.empty(); });
+	CHECK(res == OK && text == "12,34,56");
+	CHECK(device_read(loop) == "VOUT1?");
+	device_write("0.000");
+	run_for(loop, 5);
+	CHECK(vout == 0.0 && unit.pending() == 0);
+
+	// A timeout fails the whole pipeline, a late answer is dropped
+	order.clear();
+	unit.voltage([&](Result r, double v) { order.push_back(result_str(r)); });
+	unit.current([&](Result r, double v) { order.push_back(result_str(r)); });
+	CHECK(device_read(loop) == "VOUT1?IOUT1?");
+	run_until(loop, [&]() { return order.size() == 2; });
+	CHECK(order.size() == 2 && order[0] == "timeout" && order[1] == "timeout");
+	unit.voltage([&](Result r, double v) { order.push_back(result_str(r)); vout = v; });
+	device_write("5.000");
+	run_for(loop, 5);
+	CHECK(device_read(loop) == "");
+	run_for(loop, 40);
+	CHECK(device_read(loop) == "VOUT1?");
+	device_write("7.000");
+	run_for(loop, 5);
+	CHECK(order.size() == 3 && order[2] == "ok" && vout == 7.0);
+	CHECK(unit.stats.timeouts == 1 && unit.stats.stray == 5);
+
+	// An answer out of format
+	unit.voltage([&](Result r, double v) { res = r; });
+	device_read(loop);
+	device_write("OK");
+	run_for(loop, 5);
+	CHECK(res == GARBLED);
+	run_for(loop, 40);
+
+	// Closing fails whatever is left
+	unit.query("*IDN?", [&](Result r, const std::string &s) { res = r; });
+	unit.voltage([&](Result r, double v) { order.push_back(result_str(r)); });
+	unit.close();
+	CHECK(res == CLOSED && order.back() == "closed" && unit.pending() == 0);
+
+	close(dev);
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes telemetry records and reads them back through a second mapping
+
+#include "telemetry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures;
+
+#define CHECK(cond) if (!(cond)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); failures++; }
+
+#define CAPACITY 8
+
+int main()
+{
+	char name[64];
+	b3603_ring_t *ring;
+	b3603_reader_t r;
+	b3603_sample_t s;
+	uint64_t i;
+	int fd;
+
+	snprintf(name, sizeof(name), "/b3603-test.%d", (int)getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || ftruncate(fd, b3603_ring_size(CAPACITY)) < 0) {
+		perror(name);
+		return 2;
+	}
+	ring = (b3603_ring_t *)mmap(NULL, b3603_ring_size(CAPACITY), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	// Not a ring yet
+	CHECK(b3603_ring_attach(&r, name) < 0);
+
+	ring->magic = B3603_RING_MAGIC;
+	ring->version = B3603_RING_VERSION;
+	ring->sample_size = sizeof(b3603_sample_t);
+	ring->capacity = CAPACITY;
+
+	CHECK(b3603_ring_attach(&r, name) == 0);
+	CHECK(b3603_ring_read(&r, &s) == 0);
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < 3; i++) {
+		s.vout_mv = 1000 + i;
+		b3603_ring_write(ring, &s);
+	}
+	for (i = 0; i < 3; i++) {
+		CHECK(b3603_ring_read(&r, &s) == 1);
+		CHECK(s.seq == i && s.vout_mv == 1000 + i);
+	}
+	CHECK(b3603_ring_read(&r, &s) == 0);
+	CHECK(r.lost == 0);
+
+	// A reader a lap behind skips to the oldest record left
+	for (i = 3; i < 3 + CAPACITY + 5; i++) {
+		s.vout_mv = 1000 + i;
+		b3603_ring_write(ring, &s);
+	}
+	CHECK(b3603_ring_read(&r, &s) == 1);
+	CHECK(s.seq == 8 && s.vout_mv == 1008);
+	CHECK(r.lost == 5);
+	while (b3603_ring_read(&r, &s))
+		;
+	CHECK(s.seq == 15);
+
+	// A new reader starts at the newest record
+	b3603_ring_detach(&r);
+	CHECK(b3603_ring_attach(&r, name) == 0);
+	CHECK(b3603_ring_read(&r, &s) == 1 && s.seq == 15);
+	b3603_ring_detach(&r);
+
+	munmap(ring, b3603_ring_size(CAPACITY));
+	shm_unlink(name);
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
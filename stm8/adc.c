@@ -26,6 +26,18 @@
 
 static uint32_t sum;
 static uint8_t count;
+static uint8_t block_channel;
+
+/* Vin is probed with a single raw conversion after every PROBE_EVERY
+ * conversions of the other channels, so power failure detection sees it every
+ * few hundred usec instead of once per round of oversampled channels.
+ */
+#define PROBE_CHANNEL 4
+#define PROBE_EVERY 8
+
+static uint8_t probing; // The running conversion is a probe
+static uint8_t probe_ready;
+static uint16_t probe_val;
 
 void adc_init(void)
 {
@@ -45,31 +57,30 @@ inline void _adc_start(void)
 	ADC1_CR1 |= 1; // Trigger conversion
 }
 
-void adc_start(uint8_t channel)
+inline void _adc_select(uint8_t channel)
 {
 	uint8_t csr = ADC1_CSR;
 	csr &= 0x70; // Turn off EOC, Clear Channel
 	csr |= channel; // Select channel
 	ADC1_CSR = csr;
+}
+
+void adc_start(uint8_t channel)
+{
+	_adc_select(channel);
 
 	ADC1_CR1 |= 1; // Trigger conversion
 
+	block_channel = channel;
+	probing = 0;
 	sum = 0;
 	count = 0;
 }
 
+// x*a - b, clamped to zero
 fixed_t adc_to_volt(uint16_t adc, calibrate_t *cal)
 {
-	uint32_t tmp;
-
-	tmp = adc * cal->a;
-
-	if (tmp > cal->b)
-		tmp -= cal->b;
-	else
-		tmp = 0;
-
-	return fixed_round(tmp);
+	return fixed_mul_sub(adc, cal->a, cal->b);
 }
 
 inline uint16_t _adc_read(void)
@@ -93,9 +104,31 @@ uint8_t adc_channel(void)
 uint8_t adc_ready(void)
 {
 	if (ADC1_CSR & 0x80) {
-		sum += _adc_read();
+		uint16_t val = _adc_read();
+
+		if (probing) {
+			probing = 0;
+			probe_val = val;
+			probe_ready = 1;
+			_adc_select(block_channel);
+			_adc_start();
+			return 0;
+		}
+
+		sum += val;
 		count++;
+
+		if (block_channel == PROBE_CHANNEL) {
+			// Every Vin sample is as good as a probe
+			probe_val = val;
+			probe_ready = 1;
+		}
+
 		if (count < OVERSAMPLE_COUNT) {
+			if ((count & (PROBE_EVERY-1)) == 0 && block_channel != PROBE_CHANNEL) {
+				probing = 1;
+				_adc_select(PROBE_CHANNEL);
+			}
 			_adc_start();
 			return 0;
 		} else {
@@ -104,3 +137,16 @@ uint8_t adc_ready(void)
 	}
 	return 0;
 }
+
+/* Returns true with a new single, not oversampled, Vin conversion. It is
+ * scaled like adc_read() so adc_to_volt() works on it as is.
+ */
+uint8_t adc_probe(uint16_t *val)
+{
+	if (!probe_ready)
+		return 0;
+
+	probe_ready = 0;
+	*val = probe_val << OVERSAMPLE_BITS;
+	return 1;
+}
@@ -29,5 +29,6 @@ fixed_t adc_to_volt(uint16_t adc, calibrate_t *cal);
 uint16_t adc_read(void);
 uint8_t adc_channel(void);
 uint8_t adc_ready(void);
+uint8_t adc_probe(uint16_t *val);
 
 #endif
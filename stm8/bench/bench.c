@@ -0,0 +1,177 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark driver, linked with the firmware sources in place of main.c and
+ * run under the ucsim STM8 simulator by bench.py, see "make bench".
+ *
+ * Each case calls the function under test BENCH_CALLS times. bench.py stops
+ * at bench_begin() and bench_end() around every case and takes the cycle
+ * count from the simulator, the "loop" case is subtracted from the others.
+ * The case names below are read by bench.py, keep them one per line.
+ */
+
+#include "stm8s.h"
+#include <stdint.h>
+
+#include "adc.h"
+#include "config.h"
+#include "display.h"
+#include "fixedpoint.h"
+#include "outputs.h"
+#include "uart.h"
+
+#define BENCH_CALLS 16
+
+cfg_system_t cfg_system;
+cfg_output_t cfg_output;
+state_t state;
+
+void initmachine(void);
+void parseinput(uint8_t c);
+
+extern uint8_t uart_write_len;
+
+volatile uint8_t bench_count;
+volatile uint32_t bench_sink;
+
+// Called by the parser actions
+void commit_output()
+{
+}
+
+void reboot(void)
+{
+}
+
+void bench_begin(void)
+{
+	bench_count++;
+}
+
+void bench_end(void)
+{
+	bench_count++;
+}
+
+void bench_done(void)
+{
+	bench_count = 0;
+}
+
+static const uint16_t args[8] = { 0, 1, 511, 512, 2047, 4095, 8191, 0xFFFF };
+
+static void bench_loop(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++)
+		bench_sink = args[i & 7];
+}
+
+static void bench_adc_to_volt(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++)
+		bench_sink = adc_to_volt(args[i & 7] & 0x1FFF, &cfg_system.vout_adc);
+}
+
+static void bench_pwm_from_set(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++)
+		bench_sink = pwm_from_set(args[i & 7] & 0x7FFF, &cfg_system.vout_pwm);
+}
+
+static void bench_fixed_round(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++)
+		bench_sink = fixed_round((uint32_t)args[i & 7] << 12);
+}
+
+static void bench_uart_write_int32(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++) {
+		uart_write_len = 0; // Nothing drains the buffer
+		uart_write_int32((uint32_t)args[i & 7] * 40503UL);
+	}
+}
+
+// A new value every call, the worst case of the main loop
+static void bench_display_refresh(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < BENCH_CALLS; i++) {
+		display_value(DISPLAY_VOUT, args[i & 7] & 0x7FFF);
+		display_immediate();
+		display_refresh();
+	}
+}
+
+// A whole command per call
+static void bench_parseinput(void)
+{
+	static const char cmd[] = "VSET1:12.34";
+	uint8_t i, j;
+
+	for (i = 0; i < BENCH_CALLS; i++)
+		for (j = 0; j < sizeof(cmd) - 1; j++)
+			parseinput(cmd[j]);
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} bench_t;
+
+static const bench_t benches[] = {
+	{ "loop", bench_loop },
+	{ "adc_to_volt", bench_adc_to_volt },
+	{ "pwm_from_set", bench_pwm_from_set },
+	{ "fixed_round", bench_fixed_round },
+	{ "uart_write_int32", bench_uart_write_int32 },
+	{ "display_refresh", bench_display_refresh },
+	{ "parseinput", bench_parseinput },
+};
+
+int main()
+{
+	uint8_t i;
+
+	CLK_CKDIVR = 0x00; // 16 MHz, so cycles match the target
+
+	config_default_system(&cfg_system);
+	config_default_output(&cfg_output);
+	uart_init();
+	initmachine();
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		bench_begin();
+		benches[i].run();
+		bench_end();
+	}
+
+	bench_done();
+	while (1);
+}
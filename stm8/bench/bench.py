@@ -0,0 +1,163 @@
+#!/usr/bin/python
+#
+# Runs the benchmark driver (bench.c) under the ucsim STM8 simulator and
+# reports cycles per call along with the code size of every function in the
+# firmware map, compared against a stored baseline.
+#
+#   bench.py [--update] [--tolerance PCT] bench.c bench.ihx bench.map b3603.map baseline
+#
+# Without --update the exit status is 1 when a function got slower than the
+# tolerance, any function got larger or there is no baseline to compare with,
+# --update rewrites the baseline.
+
+from __future__ import print_function
+
+import re
+import subprocess
+import sys
+
+UCSIM = 'sstm8'
+UCSIM_ARGS = ['-t', 'STM8S003', '-X', '16M']
+
+def case_names(source):
+    names = []
+    in_table = False
+    for line in open(source):
+        if 'bench_t benches[]' in line:
+            in_table = True
+        elif in_table:
+            m = re.match(r'\s*\{\s*"(\w+)",', line)
+            if m:
+                names.append(m.group(1))
+            elif line.strip().startswith('}'):
+                break
+    return names
+
+# Symbols of the CODE area of an sdld map file as {name: (address, size)}
+def map_functions(mapfile):
+    area = None
+    area_end = {}
+    syms = {}
+    for line in open(mapfile):
+        m = re.match(r'^(\w+)\s+([0-9A-Fa-f]{8})\s+([0-9A-Fa-f]{8})', line)
+        if m:
+            area = m.group(1)
+            area_end[area] = int(m.group(2), 16) + int(m.group(3), 16)
+            continue
+        m = re.match(r'^\s+([0-9A-Fa-f]{8})\s+(_\w+)', line)
+        if m and area == 'CODE':
+            syms[m.group(2)[1:]] = int(m.group(1), 16)
+
+    funcs = {}
+    ordered = sorted(syms.items(), key=lambda s: s[1])
+    for i, (name, addr) in enumerate(ordered):
+        end = ordered[i+1][1] if i+1 < len(ordered) else area_end.get('CODE', addr)
+        funcs[name] = (addr, end - addr)
+    return funcs
+
+def run_cycles(source, ihx, mapfile):
+    names = case_names(source)
+    funcs = map_functions(mapfile)
+    begin, end, done = [funcs[f][0] for f in ('bench_begin', 'bench_end', 'bench_done')]
+
+    cmds = ['break 0x%x' % a for a in (begin, end, done)]
+    cmds += ['run', 'state'] * (2 * len(names) + 1)
+    cmds.append('quit')
+
+    p = subprocess.Popen([UCSIM] + UCSIM_ARGS + [ihx], stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    out = p.communicate('\n'.join(cmds) + '\n')[0]
+
+    # Every stop is followed by the state command and its total clock count
+    events = []
+    stop = None
+    for line in out.splitlines():
+        m = re.search(r'Stop at 0x([0-9a-fA-F]+)', line)
+        if m:
+            stop = int(m.group(1), 16)
+            continue
+        m = re.search(r'\((\d+) clks\)', line)
+        if m and stop is not None:
+            events.append((stop, int(m.group(1))))
+            stop = None
+
+    starts = [c for a, c in events if a == begin]
+    ends = [c for a, c in events if a == end]
+    if len(starts) != len(names) or len(ends) != len(names):
+        sys.exit('bench: expected %d cases, the simulator stopped at %d/%d\n%s' %
+                (len(names), len(starts), len(ends), out))
+
+    calls = int(re.search(r'#define BENCH_CALLS (\d+)', open(source).read()).group(1))
+    total = dict((n, e - s) for n, s, e in zip(names, starts, ends))
+    loop = total.pop('loop')
+    return dict((n, (t - loop) / float(calls)) for n, t in total.items())
+
+# None when there is no baseline yet
+def load_baseline(path):
+    base = {}
+    try:
+        for line in open(path):
+            kind, name, value = line.split()
+            base[(kind, name)] = float(value)
+    except IOError:
+        return None
+    return base
+
+def main():
+    args = sys.argv[1:]
+    update = '--update' in args
+    tolerance = 2.0
+    if '--tolerance' in args:
+        tolerance = float(args[args.index('--tolerance') + 1])
+    source, ihx, bench_map, fw_map, baseline = args[-5:]
+
+    base = load_baseline(baseline)
+    if base is None:
+        if not update:
+            sys.exit('bench: no baseline in %s, nothing to compare with. Run "make bench-baseline" '
+                    'on a known good tree and commit it' % baseline)
+        base = {}
+
+    now = {}
+    for name, cycles in run_cycles(source, ihx, bench_map).items():
+        now[('cycles', name)] = cycles
+    for name, (addr, size) in map_functions(fw_map).items():
+        now[('size', name)] = size
+
+    failed = False
+
+    print('%-6s %-28s %10s %10s %8s' % ('', 'function', 'now', 'baseline', 'change'))
+    for key in sorted(now):
+        kind, name = key
+        value = now[key]
+        old = base.get(key)
+        if old is None:
+            change = 'new'
+        elif old == value:
+            if kind == 'size':
+                continue # Only show sizes that moved
+            change = ''
+        else:
+            change = '%+.1f%%' % ((value - old) * 100.0 / old) if old else '%+d' % (value - old)
+            if (kind == 'cycles' and value > old * (1 + tolerance / 100.0)) or (kind == 'size' and value > old):
+                change += ' !'
+                failed = True
+        print('%-6s %-28s %10g %10s %8s' % (kind, name, value, '' if old is None else '%g' % old, change))
+
+    for key in sorted(set(base) - set(now)):
+        print('%-6s %-28s %10s %10g %8s' % (key[0], key[1], '', base[key], 'gone'))
+
+    code = sum(v for (k, n), v in now.items() if k == 'size')
+    print('CODE total %d bytes' % code)
+
+    if update:
+        with open(baseline, 'w') as f:
+            for key in sorted(now):
+                f.write('%s %s %g\n' % (key[0], key[1], now[key]))
+        print('Baseline written to %s' % baseline)
+    elif failed:
+        print('Regressions marked with !, run "make bench-baseline" if they are expected')
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,323 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Resident bootloader in the first BOOT_APP_START - BOOT_START bytes of flash.
+ *
+ * At reset it checks the image descriptor in the last flash block: a length,
+ * the CRC of that many bytes from BOOT_APP_START and a magic, written only
+ * after the whole image was programmed and its CRC checked. With a valid image
+ * it waits BOOT_WINDOW msec for BOOT_SYNC on the UART and otherwise starts the
+ * application, without one it stays and waits for an upload, so an update cut
+ * short by a power loss or a bad image always leaves a unit that can be
+ * updated again.
+ *
+ * The application gets here by resetting, see the BOOT command. The vector
+ * table is ours, every interrupt goes on to the one in the application's.
+ * Flash is written a word at a time, which stalls the CPU for each word, so
+ * the host waits for the answer to every block before sending the next.
+ */
+
+#include <stdint.h>
+
+#include "stm8s.h"
+#include "boot.h"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#ifdef __SDCC
+#define REDIRECT(n) \
+	void redirect_##n(void) __interrupt(n) __naked \
+	{ __asm__("jpf " #n "*4+" XSTR(BOOT_APP_START) "+8"); }
+
+void redirect_trap(void) __trap __naked
+{
+	__asm__("jpf " XSTR(BOOT_APP_START) "+4");
+}
+
+REDIRECT(0) REDIRECT(1) REDIRECT(2) REDIRECT(3) REDIRECT(4) REDIRECT(5)
+REDIRECT(6) REDIRECT(7) REDIRECT(8) REDIRECT(9) REDIRECT(10) REDIRECT(11)
+REDIRECT(12) REDIRECT(13) REDIRECT(14) REDIRECT(15) REDIRECT(16) REDIRECT(17)
+REDIRECT(18) REDIRECT(19) REDIRECT(20) REDIRECT(21) REDIRECT(22) REDIRECT(23)
+REDIRECT(24) REDIRECT(25) REDIRECT(26) REDIRECT(27) REDIRECT(28) REDIRECT(29)
+#endif
+
+#define INFO_LEN 0 // Offsets in the descriptor
+#define INFO_CRC 2
+#define INFO_MAGIC 4
+
+static const uint8_t magic[4] = { 'B', '3', '6', '0' };
+
+static uint8_t frame[2 + 1 + BOOT_BLOCK + 2];
+
+static uint16_t crc16(uint16_t crc, const uint8_t *p, uint16_t len)
+{
+	uint8_t i;
+
+	while (len--) {
+		crc ^= (uint16_t)*p++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint8_t image_valid(void)
+{
+	uint8_t *info = MEM(BOOT_INFO);
+	uint16_t len = get16(info + INFO_LEN);
+	uint8_t i;
+
+	for (i = 0; i < 4; i++)
+		if (info[INFO_MAGIC + i] != magic[i])
+			return 0;
+
+	return len > 0 && len <= BOOT_APP_SIZE &&
+		crc16(0xFFFF, MEM(BOOT_APP_START), len) == get16(info + INFO_CRC);
+}
+
+// True once per msec
+static uint8_t tick(void)
+{
+	if (!(TIM4_SR & TIM_SR1_UIF))
+		return 0;
+	TIM4_SR = 0;
+	return 1;
+}
+
+// The next byte, -1 after msec without one
+static int16_t getc_wait(uint16_t msec)
+{
+	while (!(USART1_SR & USART_SR_RXNE)) {
+		if (tick() && --msec == 0)
+			return -1;
+	}
+
+	return USART1_DR;
+}
+
+static void put_byte(uint8_t c)
+{
+	while (!(USART1_SR & USART_SR_TXE))
+		;
+	USART1_DR = c;
+}
+
+// Reads len more bytes of a command to frame + at, 0 if the host went quiet
+static uint8_t get_frame(uint8_t at, uint8_t len)
+{
+	int16_t c;
+
+	for (; len > 0; len--) {
+		c = getc_wait(100);
+		if (c < 0)
+			return 0;
+		frame[at++] = c;
+	}
+
+	return 1;
+}
+
+static uint8_t flash_unlock(void)
+{
+	FLASH_PUKR = 0x56;
+	FLASH_PUKR = 0xAE;
+
+	return (FLASH_IAPSR & FLASH_IAPSR_PUL);
+}
+
+static void flash_lock(void)
+{
+	FLASH_IAPSR &= ~FLASH_IAPSR_PUL;
+}
+
+// Word programming of an aligned word, unlocked, true if it reads back
+static uint8_t flash_word(uint8_t *dst, const uint8_t *src)
+{
+	uint16_t timeout;
+	uint8_t sr = 0;
+
+	if (dst[0] == src[0] && dst[1] == src[1] && dst[2] == src[2] && dst[3] == src[3])
+		return 1;
+
+	FLASH_CR2 = FLASH_CR2_WPRG;
+	FLASH_NCR2 = (uint8_t)~FLASH_NCR2_NWPRG;
+	dst[0] = src[0];
+	dst[1] = src[1];
+	dst[2] = src[2];
+	dst[3] = src[3];
+
+	for (timeout = 0xFFFF; timeout > 0; timeout--) {
+		sr = FLASH_IAPSR;
+		if (sr & (FLASH_IAPSR_EOP | FLASH_IAPSR_WR_PG_DIS))
+			break;
+	}
+
+	return !(sr & FLASH_IAPSR_WR_PG_DIS) &&
+		dst[0] == src[0] && dst[1] == src[1] && dst[2] == src[2] && dst[3] == src[3];
+}
+
+static uint8_t flash_write(uint8_t *dst, const uint8_t *src, uint8_t len)
+{
+	uint8_t ok = flash_unlock();
+
+	for (; ok && len > 0; len -= 4, dst += 4, src += 4)
+		ok = flash_word(dst, src);
+
+	flash_lock();
+	return ok;
+}
+
+static uint8_t cmd_erase(void)
+{
+	static const uint8_t blank[4] = { 0, 0, 0, 0 };
+
+	return flash_write(MEM(BOOT_INFO + INFO_MAGIC), blank, 4);
+}
+
+static uint8_t cmd_write(void)
+{
+	uint16_t offset;
+	uint8_t len;
+
+	if (!get_frame(0, 3))
+		return 0;
+	offset = get16(frame);
+	len = frame[2];
+
+	if (len > BOOT_BLOCK || !get_frame(3, len + 2))
+		return 0;
+	if (crc16(0xFFFF, frame, 3 + len) != get16(frame + 3 + len))
+		return 0;
+	if ((offset & 3) || (len & 3) || offset + len > BOOT_APP_SIZE)
+		return 0;
+
+	return flash_write(MEM(BOOT_APP_START + offset), frame + 3, len);
+}
+
+static uint8_t cmd_verify(void)
+{
+	uint8_t info[8];
+	uint16_t len;
+	uint8_t i;
+
+	if (!get_frame(0, 6) || crc16(0xFFFF, frame, 4) != get16(frame + 4))
+		return 0;
+
+	len = get16(frame);
+	if (len == 0 || len > BOOT_APP_SIZE || crc16(0xFFFF, MEM(BOOT_APP_START), len) != get16(frame + 2))
+		return 0;
+
+	for (i = 0; i < 4; i++) {
+		info[INFO_LEN + i] = frame[i];
+		info[INFO_MAGIC + i] = magic[i];
+	}
+
+	// The magic goes in last
+	return flash_write(MEM(BOOT_INFO), info, 4) && flash_write(MEM(BOOT_INFO + 4), info + 4, 4);
+}
+
+static void start_app(void)
+{
+	while (!(USART1_SR & USART_SR_TC))
+		;
+
+	// Back to the reset state for the application
+	USART1_CR2 = 0;
+	USART1_BRR2 = 0;
+	USART1_BRR1 = 0;
+	TIM4_CR1 = 0;
+	TIM4_PSCR = 0;
+	TIM4_ARR = 0xFF;
+	TIM4_SR = 0;
+
+#ifdef __SDCC
+	// Its vector table starts with the reset vector, fresh stack
+	__asm__("ldw x, #0x03FF\n ldw sp, x\n jp " XSTR(BOOT_APP_START));
+#elif SIM
+	sim_jump(BOOT_APP_START);
+#endif
+}
+
+// True if BOOT_SYNC came in within msec
+static uint8_t wait_sync(uint16_t msec)
+{
+	while (msec > 0) {
+		if ((USART1_SR & USART_SR_RXNE) && USART1_DR == BOOT_SYNC)
+			return 1;
+		if (tick())
+			msec--;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	uint8_t ok;
+	int16_t c;
+
+	CLK_CKDIVR = 0x00; // 16 MHz
+
+	// Keep the output off while we are here, PB4 high disables it
+	PB_ODR = (1<<4);
+	PB_DDR = (1<<4);
+	PB_CR1 = (1<<4);
+
+	USART1_BRR2 = BOOT_BRR2;
+	USART1_BRR1 = BOOT_BRR1; // BRR1 last
+	USART1_CR2 = USART_CR2_TEN | USART_CR2_REN;
+
+	TIM4_PSCR = 6; // 16MHz / 64 = 250kHz
+	TIM4_ARR = 249; // 1 msec
+	TIM4_CR1 = TIM_CR1_CEN;
+
+	if (image_valid()) {
+		if (!wait_sync(BOOT_WINDOW))
+			start_app();
+		put_byte(BOOT_ACK);
+	}
+
+	while (1) {
+		c = getc_wait(0xFFFF);
+
+		switch (c) {
+			case -1: continue;
+			case BOOT_SYNC: ok = 1; break;
+			case BOOT_CMD_ERASE: ok = cmd_erase(); break;
+			case BOOT_CMD_WRITE: ok = cmd_write(); break;
+			case BOOT_CMD_VERIFY: ok = cmd_verify(); break;
+			case BOOT_CMD_GO:
+				ok = image_valid();
+				if (ok) {
+					put_byte(BOOT_ACK);
+					start_app();
+				}
+				break;
+			default: ok = 0; break;
+		}
+
+		put_byte(ok ? BOOT_ACK : BOOT_NACK);
+	}
+}
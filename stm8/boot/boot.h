@@ -0,0 +1,57 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+/* Flash layout and protocol of the resident UART bootloader, see boot.c. The
+ * Makefile takes the addresses from here, upload.py has its own copy.
+ */
+#define BOOT_START 0x8000
+#define BOOT_APP_START 0x8400 // The application, linked with its vector table first
+#define BOOT_INFO 0x9FC0 // Last flash block, holds the image descriptor
+#define BOOT_FLASH_END 0xA000
+#define BOOT_APP_SIZE (BOOT_INFO - BOOT_APP_START)
+
+#define BOOT_WINDOW 200 // msec after reset to wait for BOOT_SYNC
+#define BOOT_BLOCK 64 // Most data bytes in one write
+
+// 115200 baud at 16MHz, divider 139
+#define BOOT_BRR1 0x08
+#define BOOT_BRR2 0x0B
+
+#define BOOT_SYNC 0x7F
+#define BOOT_ACK 0x79
+#define BOOT_NACK 0x1F
+
+/* Commands, every one is answered with BOOT_ACK or BOOT_NACK.
+ *   'E'                            invalidate the image
+ *   'W' <offset:2> <len> <data> <crc:2>
+ *                                  program len bytes at offset into the image,
+ *                                  offset and len multiples of 4
+ *   'V' <len:2> <crc:2> <check:2>  check the image CRC and validate it
+ *   'G'                            start a valid image
+ * Numbers are big endian, the CRC is CRC-16/CCITT (0x1021, start 0xFFFF)
+ * over the bytes from offset or len on.
+ */
+#define BOOT_CMD_ERASE 'E'
+#define BOOT_CMD_WRITE 'W'
+#define BOOT_CMD_VERIFY 'V'
+#define BOOT_CMD_GO 'G'
+
+#endif
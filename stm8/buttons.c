@@ -0,0 +1,131 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "buttons.h"
+#include "stm8s.h"
+
+/* The README notes that all four buttons share the two pins, the buttons
+ * pull their pin low through the digit lines of the display. A pin can only
+ * be seen low while its digit is selected, so the pins are sampled on every
+ * display interrupt and a button counts as pressed if its pin was low at any
+ * time during the last frame of BUTTON_TICK_MS. Either button on a pin is
+ * the same button to us. A button changes state only after DEBOUNCE_MASK
+ * frames in a row agree and the resulting events are queued for the main
+ * loop, which never waits on them.
+ */
+#define BUTTONS 2
+#define BUTTON_TICK_MS 4 // One display frame
+#define DEBOUNCE_MASK 0x0F // 16 msec
+#define BUTTON_LONG_TICKS (800 / BUTTON_TICK_MS)
+#define BUTTON_REPEAT_TICKS (152 / BUTTON_TICK_MS)
+#define QUEUE_SIZE 8 // Power of two
+
+typedef struct {
+	uint8_t history; // One bit per frame, 1 is pressed
+	uint8_t down;
+	uint8_t held; // Frames
+	uint8_t repeat; // Frames to the next BUTTON_REPEAT
+} button_t;
+
+static button_t buttons[BUTTONS];
+static uint8_t sampled; // Bit per button, low pin seen in this frame
+
+static uint8_t queue[QUEUE_SIZE];
+static volatile uint8_t queue_head; // Only written by buttons_tick()
+static volatile uint8_t queue_tail; // Only written by buttons_event()
+
+static void buttons_push(uint8_t event)
+{
+	uint8_t head = queue_head;
+
+	if ((uint8_t)(head - queue_tail) == QUEUE_SIZE)
+		return; // Nobody is listening, drop it
+
+	queue[head & (QUEUE_SIZE-1)] = event;
+	queue_head = head + 1;
+}
+
+// Called from every display interrupt, before the digit changes
+void buttons_sample(void)
+{
+	if (!(PC_IDR & (1<<7)))
+		sampled |= 1<<BUTTON_1;
+	if (!(PD_IDR & (1<<1)))
+		sampled |= 1<<BUTTON_2;
+}
+
+// Called from the systick interrupt once per BUTTON_TICK_MS
+void buttons_tick(void)
+{
+	uint8_t i;
+	uint8_t pins = sampled;
+
+	sampled = 0;
+
+	for (i = 0; i < BUTTONS; i++) {
+		button_t *b = &buttons[i];
+
+		b->history = ((b->history << 1) | ((pins >> i) & 1)) & DEBOUNCE_MASK;
+
+		if (!b->down) {
+			if (b->history == DEBOUNCE_MASK) {
+				b->down = 1;
+				b->held = 0;
+				buttons_push(BUTTON_EVENT(i, BUTTON_PRESS));
+			}
+			continue;
+		}
+
+		if (b->history == 0) {
+			b->down = 0;
+			buttons_push(BUTTON_EVENT(i, BUTTON_RELEASE));
+			continue;
+		}
+
+		if (b->held < BUTTON_LONG_TICKS) {
+			if (++b->held == BUTTON_LONG_TICKS) {
+				b->repeat = BUTTON_REPEAT_TICKS;
+				buttons_push(BUTTON_EVENT(i, BUTTON_LONG));
+			}
+		} else if (--b->repeat == 0) {
+			b->repeat = BUTTON_REPEAT_TICKS;
+			buttons_push(BUTTON_EVENT(i, BUTTON_REPEAT));
+		}
+	}
+}
+
+// Returns the next event or 0 if there is none
+uint8_t buttons_event(void)
+{
+	uint8_t tail = queue_tail;
+	uint8_t event;
+
+	if (tail == queue_head)
+		return 0;
+
+	event = queue[tail & (QUEUE_SIZE-1)];
+	queue_tail = tail + 1;
+	return event;
+}
+
+// Bit mask of the buttons held down after debouncing
+uint8_t buttons_down(void)
+{
+	return (buttons[BUTTON_1].down ? (1<<BUTTON_1) : 0) |
+		(buttons[BUTTON_2].down ? (1<<BUTTON_2) : 0);
+}
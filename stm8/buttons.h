@@ -0,0 +1,48 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+#include <stdint.h>
+
+#define BUTTON_1 0 // PC7
+#define BUTTON_2 1 // PD1
+
+// Event types, an event is (button << 4) | type
+#define BUTTON_PRESS 1
+#define BUTTON_LONG 2 // Held for 800 msec
+#define BUTTON_REPEAT 3 // Every 150 msec after BUTTON_LONG while held
+#define BUTTON_RELEASE 4
+
+#define BUTTON_EVENT(button, type) (((button) << 4) | (type))
+#define BUTTON_OF(event) ((event) >> 4)
+#define BUTTON_TYPE(event) ((event) & 0x0F)
+
+#if FEATURE_UI
+void buttons_sample(void);
+void buttons_tick(void);
+uint8_t buttons_event(void);
+uint8_t buttons_down(void);
+#else
+// Built without the buttons, see FEATURES in the Makefile
+#define buttons_sample()
+#define buttons_tick()
+#endif
+
+#endif
@@ -6,6 +6,10 @@ import time
 import csv
 import os
 import math
+import atexit
+import collections
+import subprocess
+import threading
 
 def calc_average(data):
     return reduce(lambda x,y: x+y, data) / len(data)
@@ -141,39 +145,151 @@ class B3603(object):
     def current(self, c):
         return self.command("CURRENT %.3f" % c)
 
+    def open_korad(self):
+        self.s = serial.Serial(self.portname, baudrate=38400, bytesize=serial.EIGHTBITS, parity=serial.PARITY_NONE, stopbits=serial.STOPBITS_ONE, timeout=0.2)
+        if not self.s.isOpen():
+            return False
+        self.clear_input()
+        self.ser_write('*IDN?')
+        s = self.s.read(64)
+        print 'OPEN "%s"' % s
+        return s != ''
+
+    # Korad commands have no terminator and no answer
+    def korad(self, cmd):
+        self.ser_write(cmd)
+        time.sleep(0.05)
+
+    def sweep(self, channel, first, last, step, settle, window_start):
+        """Runs SWEEP on the device, window_start(compare) is called when a
+        measurement window starts and returns a callable that gives the
+        reference reading at the end of the window. Returns a list of
+        (compare, vout_raw, cout_raw, vin_raw, reference)."""
+        self.korad('SWEEP:%d,%d,%d,%d' % (first, last, step, settle))
+        self.ser_write('SWEEP%d' % channel)
+
+        rows = []
+        pending = None
+        line = ''
+        idle = 0
+        while idle < 5 * (settle / 200.0 + 1):
+            ch = self.s.read()
+            if ch == '':
+                idle += 1
+                continue
+            idle = 0
+            if ch != '\n':
+                line += ch
+                continue
+            line = line.strip()
+            if self.debug:
+                print 'DEBUG IN', line
+            if line.startswith('S'):
+                pending = window_start(int(line[1:]))
+            elif line in ('END', 'ABORT'):
+                return rows if line == 'END' else None
+            elif pending:
+                vals = [int(x) for x in line.split(',')]
+                rows.append(tuple(vals) + (pending(),))
+                pending = None
+            line = ''
+        print 'Sweep timed out'
+        return None
+
 class Multimeter(object):
+    """Keeps one continuous sigrok-cli acquisition open and timestamps every
+    reading in a background thread, so that no reading pays for starting
+    sigrok-cli and reconnecting to the meter. The model "fake" runs
+    fake_meter.py instead, with the port being a b3603-sim -p trace file or
+    "-" for a fixed 5V."""
+
+    HISTORY = 4096 # Readings kept
+
     def __init__(self, portname, model):
         self.portname = portname
         self.model = model
+        self.proc = None
+        self.samples = collections.deque(maxlen=self.HISTORY)
+        self.cond = threading.Condition()
+
+    def _command(self):
+        if self.model == 'fake':
+            return [sys.executable, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fake_meter.py'), self.portname]
+        return ['sigrok-cli', '-d', '%s:conn=%s' % (self.model, self.portname), '-O', 'analog', '--continuous']
+
+    def _reader(self):
+        for line in iter(self.proc.stdout.readline, ''):
+            now = time.time()
+            try:
+                value = float(line.split(' ')[1])
+            except (IndexError, ValueError):
+                continue # Not a reading
+            with self.cond:
+                self.samples.append((now, value))
+                self.cond.notify_all()
+        with self.cond:
+            self.proc.wait()
+            self.cond.notify_all()
+
+    def open(self, timeout=10):
+        self.proc = subprocess.Popen(self._command(), stdout=subprocess.PIPE, universal_newlines=True)
+        self.thread = threading.Thread(target=self._reader)
+        self.thread.daemon = True
+        self.thread.start()
+        atexit.register(self.close) # Don't leave the acquisition running
+        return self.wait_after(0, timeout)
 
-    def open(self):
-        return self._sample() != None
+    def close(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.terminate()
+            self.thread.join(1)
+
+    def wait_after(self, t, timeout=5):
+        """Waits for a reading taken after time t, returns False on timeout or
+        when the acquisition ended."""
+        deadline = time.time() + timeout
+        with self.cond:
+            while not self.samples or self.samples[-1][0] <= t:
+                left = deadline - time.time()
+                if left <= 0 or self.proc.poll() is not None:
+                    return False
+                self.cond.wait(left)
+        return True
+
+    def _average(self, data):
+        if not data:
+            return None
+        avg = calc_average(data)
+        stddev = calc_stddev(data, avg)
+        if stddev > 0.1:
+            print 'Multimeter samples vary too much, stddev=%f, data:' % stddev, data
+            return None
+        return avg
 
-    def _sample(self):
-        p = os.popen('sigrok-cli -d %s:conn=%s --samples 1' % (self.model, self.portname))
-        s = p.read()
-        p.close()
-        return float(s.split(' ')[1])
+    def window(self, start, end):
+        """Average of the readings taken between start and end, once a reading
+        after end is in."""
+        if not self.wait_after(end):
+            return None
+        with self.cond:
+            return self._average([v for (t, v) in self.samples if start <= t < end])
 
     def sample1(self, count):
+        """Average of the next count readings."""
         count = int(count)
         if count < 1:
             raise Exception("Invalid count value, must be above 0")
-        if count == 1:
-            return self._sample()
-
+        with self.cond:
+            last = self.samples[-1][0] if self.samples else 0
         data = []
-        for i in xrange(count):
-            data.append(self._sample())
-            if data[-1] == None:
+        while len(data) < count:
+            if not self.wait_after(last):
                 return None
-
-        avg = calc_average(data)
-        stddev = calc_stddev(data, avg)
-        if stddev > 0.1:
-            print 'Multimeter samples vary too much, stddev=%f, data:' % stddev, data
-            return None
-        return avg
+            with self.cond:
+                new = [(t, v) for (t, v) in self.samples if t > last]
+            data += [v for (t, v) in new]
+            last = new[-1][0]
+        return self._average(data[:count])
 
     def sample3(self, count):
         for i in range(3):
@@ -295,6 +411,72 @@ def auto_calibration():
 
     psu.close()
 
+def sweep_calibration():
+    """Vout calibration in a single device side sweep, the meter readings
+    are averaged over the same window as the firmware averages its ADC."""
+    psu = B3603(sys.argv[2])
+    if not psu.open_korad():
+        print 'Failed to open serial port to B3603 on serial %s' % sys.argv[2]
+        return
+
+    dmm = Multimeter(sys.argv[3], sys.argv[4])
+    if not dmm.open():
+        print 'Failed to open serial port to multimeter on serial %s model %s' % (sys.argv[3], sys.argv[4])
+        psu.close()
+        return
+
+    max_voltage = float(sys.argv[5]) if len(sys.argv) > 5 else 10.0
+    NUM_STEPS = 20
+    SETTLE = 500 # msec, the window to read the meter is as long again
+
+    # Compare values from the default calibration, the fit does not depend on them
+    first = int(1000 * 0.177 + 33)
+    last = int(max_voltage * 1000 * 0.177 + 33)
+    step = max(1, (last - first) / (NUM_STEPS - 1))
+
+    # The first fifth of the window is left for the meter to catch up
+    def window_start(ctr):
+        start = time.time()
+        def done():
+            end = time.time()
+            return dmm.window(start + (end - start) / 5, end)
+        return done
+
+    psu.korad('ISET1:1.000')
+    start = time.time()
+    rows = psu.sweep(1, first, last, step, SETTLE, window_start)
+    print 'Sweep took %.1f seconds' % (time.time() - start)
+    if not rows:
+        print 'Sweep failed, calibration cancelled'
+        psu.close()
+        return
+
+    pwm_data = []
+    adc_data = []
+    vout_data = []
+    for (ctr, vout_raw, cout_raw, vin_raw, vout) in rows:
+        if vout == None or vout < 0.1:
+            print 'Compare %d: no usable meter reading (%s), skipped' % (ctr, vout)
+            continue
+        print 'Compare %d ADC %d Read voltage %f' % (ctr, vout_raw, vout)
+        pwm_data.append(ctr)
+        adc_data.append(vout_raw)
+        vout_data.append(int(vout*1000))
+
+    if len(vout_data) < 2:
+        print 'Not enough points, calibration cancelled'
+        psu.close()
+        return
+
+    print 'ADC'
+    val = lse(adc_data, vout_data)
+    print val, int(val[0]*65536), int(max(0, -val[1])*65536)
+    print 'PWM'
+    val = lse(vout_data, pwm_data)
+    print val, int(val[0]*65536), int(val[1]*65536)
+
+    psu.close()
+
 def manual_calibration():
     print 'Not implemented'
 
@@ -304,6 +486,10 @@ def usage():
     print 'or:'
     print
     print '%s -m <b3603 serial>' % sys.argv[0]
+    print
+    print 'or, with the device side sweep:'
+    print
+    print '%s -s <b3603 serial> <multimeter serial> <multimeter model> [max volts]' % sys.argv[0]
 
 def main():
     if len(sys.argv) < 2:
@@ -315,6 +501,12 @@ def main():
         else:
             auto_calibration()
 
+    if sys.argv[1] == '-s':
+        if len(sys.argv) not in (5, 6):
+            return usage()
+        else:
+            sweep_calibration()
+
     if sys.argv[1] == '-m':
         if len(sys.argv) != 3:
             return usage()
@@ -0,0 +1,215 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "capture.h"
+#include "adc.h"
+#include "uart.h"
+
+/* Burst capture of raw conversions of one channel. While armed the ADC runs in
+ * continuous mode on that channel and every result is taken by the end of
+ * conversion interrupt into a ring buffer, so the samples before the trigger
+ * are kept. After the trigger the ring is filled once more past the pre
+ * trigger samples and the ADC is handed back to the oversampled readings,
+ * which hold their last values in the meantime.
+ */
+#define CAPTURE_SIZE 32 // Samples, must be a power of two, 64 bytes of RAM
+#define CAPTURE_NSEC 15750 // 14 ADC clocks at fMASTER/18 per conversion
+
+#define STATE_IDLE 0
+#define STATE_ARMED 1
+#define STATE_TRIGGERED 2
+#define STATE_DONE 3
+
+#define DUMP_LINE 8 // Samples per line
+#define DUMP_ROOM (DUMP_LINE * 5 + 2) // Free output buffer needed for one line
+
+static uint16_t params[5] = { 2, CAPTURE_IMMEDIATE, 0, CAPTURE_SIZE / 4, 1 };
+static uint16_t samples[CAPTURE_SIZE];
+static uint8_t head; // Next slot to write, the oldest sample once done
+static uint8_t filled;
+static uint8_t left; // Samples still to take after the trigger
+static uint8_t tick;
+static uint8_t drop;
+static uint8_t pending; // Trigger source seen since arming
+static uint8_t cap_state;
+static uint8_t release; // The ADC has to be restarted for the readings
+static uint8_t dump_pos;
+static uint8_t dump_left;
+
+void capture_param(uint8_t param, uint16_t val)
+{
+	params[param] = val;
+}
+
+static uint8_t capture_busy(void)
+{
+	return cap_state == STATE_ARMED || cap_state == STATE_TRIGGERED;
+}
+
+/* True while the readings must leave the ADC alone. The pass after a capture
+ * ends starts them over, a conversion left over from it is discarded.
+ */
+uint8_t capture_owns_adc(void)
+{
+	if (capture_busy())
+		return 1;
+
+	if (release) {
+		release = 0;
+		adc_start(2);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Interrupts are off or we are in the ADC interrupt
+static void capture_halt(uint8_t new_state)
+{
+	ADC1_CR1 &= ~0x02; // Single conversion
+	ADC1_CSR &= ~0x20; // No EOC interrupt
+	cap_state = new_state;
+	release = 1;
+}
+
+void capture_arm(void)
+{
+	uint8_t ch = params[CAPTURE_CHANNEL];
+
+	if (ch < 2 || ch > 4 || params[CAPTURE_PRE] >= CAPTURE_SIZE || params[CAPTURE_EVERY] == 0 || params[CAPTURE_EVERY] > 255)
+		return;
+
+	disable_interrupts();
+	head = 0;
+	filled = 0;
+	tick = 0;
+	drop = 1; // The conversion under way may be for another channel
+	pending = 0;
+	dump_left = 0;
+	cap_state = STATE_ARMED;
+
+	ADC1_CSR = 0x20 | ch; // Clear EOC, EOC interrupt on
+	ADC1_CR1 |= 0x02 | 0x01; // Continuous conversion, start
+	enable_interrupts();
+}
+
+void capture_stop(void)
+{
+	disable_interrupts();
+	if (capture_busy())
+		capture_halt(STATE_IDLE);
+	enable_interrupts();
+}
+
+/* Called when a trigger source fires, from the main loop or an interrupt. The
+ * next sample takes it.
+ */
+void capture_event(uint8_t source)
+{
+	if (cap_state == STATE_ARMED)
+		pending = source;
+}
+
+void capture_isr(void) INTERRUPT(ADC1_IRQ)
+{
+	uint16_t val = ADC1_DRL;
+	uint16_t prev;
+	uint8_t trig;
+
+	val |= ADC1_DRH << 8;
+	ADC1_CSR &= 0x7F; // Clear EOC
+
+	if (drop) {
+		drop = 0;
+		return;
+	}
+	if (++tick < params[CAPTURE_EVERY])
+		return;
+	tick = 0;
+
+	prev = samples[(head - 1) & (CAPTURE_SIZE-1)];
+	samples[head] = val;
+	head = (head + 1) & (CAPTURE_SIZE-1);
+	if (filled < CAPTURE_SIZE)
+		filled++;
+
+	if (cap_state == STATE_TRIGGERED) {
+		if (--left == 0)
+			capture_halt(STATE_DONE);
+		return;
+	}
+
+	// Wait until there are enough samples from before the trigger
+	if (filled <= params[CAPTURE_PRE])
+		return;
+
+	trig = params[CAPTURE_TRIGGER];
+	if (trig == CAPTURE_RISING)
+		trig = filled > 1 && prev < params[CAPTURE_LEVEL] && val >= params[CAPTURE_LEVEL];
+	else if (trig == CAPTURE_FALLING)
+		trig = filled > 1 && prev >= params[CAPTURE_LEVEL] && val < params[CAPTURE_LEVEL];
+	else
+		trig = trig == CAPTURE_IMMEDIATE || pending == trig;
+
+	if (trig) {
+		cap_state = STATE_TRIGGERED;
+		left = CAPTURE_SIZE - 1 - params[CAPTURE_PRE];
+		if (left == 0)
+			capture_halt(STATE_DONE);
+	}
+}
+
+/* "<state>,<channel>,<samples>,<pre>,<nsec per sample>", once done the samples
+ * follow oldest first from capture_drive(), DUMP_LINE to a line. The sample
+ * after the pre trigger ones is the first one taken after the trigger.
+ */
+void capture_report(void)
+{
+	static const char * const names[] = { "IDLE", "ARMED", "TRIGGERED", "DONE" };
+	uint8_t done = cap_state == STATE_DONE;
+
+	uart_write_str(names[cap_state]);
+	uart_write_ch(',');
+	uart_write_int(params[CAPTURE_CHANNEL]);
+	uart_write_ch(',');
+	uart_write_int(done ? CAPTURE_SIZE : 0);
+	uart_write_ch(',');
+	uart_write_int(params[CAPTURE_PRE]);
+	uart_write_ch(',');
+	uart_write_int32((uint32_t)CAPTURE_NSEC * params[CAPTURE_EVERY]);
+
+	if (done) {
+		dump_pos = head;
+		dump_left = CAPTURE_SIZE;
+	}
+}
+
+void capture_drive(void)
+{
+	uint8_t i;
+
+	if (!dump_left || uart_write_room() < DUMP_ROOM)
+		return;
+
+	for (i = 0; i < DUMP_LINE; i++) {
+		uart_write_str(i ? "," : "\r\n");
+		uart_write_int(samples[dump_pos]);
+		dump_pos = (dump_pos + 1) & (CAPTURE_SIZE-1);
+	}
+	dump_left -= DUMP_LINE;
+}
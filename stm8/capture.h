@@ -0,0 +1,54 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#include "stm8s.h"
+
+#define CAPTURE_IMMEDIATE 0
+#define CAPTURE_ON_OUTPUT 1 // Output turned on
+#define CAPTURE_ON_CC 2 // CV to CC transition
+#define CAPTURE_RISING 3 // Sample goes from below the level to at or above it
+#define CAPTURE_FALLING 4 // Sample goes from at or above the level to below it
+
+#define CAPTURE_CHANNEL 0
+#define CAPTURE_TRIGGER 1
+#define CAPTURE_LEVEL 2
+#define CAPTURE_PRE 3
+#define CAPTURE_EVERY 4
+
+#if FEATURE_CAPTURE
+void capture_param(uint8_t param, uint16_t val);
+void capture_arm(void);
+void capture_stop(void);
+void capture_event(uint8_t source);
+uint8_t capture_owns_adc(void);
+void capture_isr(void) INTERRUPT(ADC1_IRQ);
+void capture_report(void);
+void capture_drive(void);
+#else
+// Built without the burst capture, see FEATURES in the Makefile
+#define capture_event(source)
+#define capture_owns_adc() 0
+#define capture_drive()
+#endif
+
+#endif
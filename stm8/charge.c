@@ -0,0 +1,137 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "charge.h"
+#include "config.h"
+#include "energy.h"
+#include "systick.h"
+#include "uart.h"
+
+extern cfg_system_t cfg_system;
+extern cfg_output_t cfg_output;
+extern state_t state;
+
+void commit_output(void);
+
+#if !FEATURE_ENERGY
+#error The charge mode counts mAh with the energy counters, build with FEATURES=ENERGY too
+#endif
+
+/* The current is low pass filtered as filt = 7/8 filt + cout, i.e. it holds
+ * 8 times the average, and has to stay under the termination current for a
+ * number of consecutive readings before we believe the charge is done.
+ */
+#define FILTER_SHIFT 3
+#define TERM_READINGS 32
+
+static uint8_t charge_state;
+static uint8_t below_count;
+static uint16_t filt;
+static uint32_t start_time;
+static uint32_t start_mah;
+static uint32_t end_time;
+
+static void charge_end(uint8_t reason)
+{
+	charge_state = reason;
+	end_time = systick_now();
+
+	if (cfg_system.output) {
+		cfg_system.output = 0;
+		commit_output();
+	}
+}
+
+void charge_start(void)
+{
+	charge_state = CHARGE_CC;
+	below_count = 0;
+	filt = cfg_output.cset << FILTER_SHIFT; // Don't start below the limit
+	start_time = systick_now();
+	start_mah = energy.mah;
+
+	// The CC and CV limits are the regular cset and vset
+	cfg_system.output = 1;
+	state.fault = 0;
+	commit_output();
+}
+
+void charge_stop(void)
+{
+	if (charge_state == CHARGE_CC || charge_state == CHARGE_CV)
+		charge_end(CHARGE_ABORTED);
+}
+
+// Called for every new current reading
+void charge_update(uint16_t cout)
+{
+	uint32_t elapsed;
+
+	if (charge_state != CHARGE_CC && charge_state != CHARGE_CV)
+		return;
+
+	if (!cfg_system.output) {
+		// OUT0 or a protection trip
+		charge_end(CHARGE_ABORTED);
+		return;
+	}
+
+	filt = filt - (filt >> FILTER_SHIFT) + cout;
+	charge_state = state.constant_current ? CHARGE_CC : CHARGE_CV;
+
+	elapsed = systick_now() - start_time;
+	if (cfg_output.charge_timeout && elapsed >= cfg_output.charge_timeout * 60000UL) {
+		charge_end(CHARGE_TIMEOUT);
+		return;
+	}
+
+	// Only a CV phase can end on current, in CC the current is the limit
+	if (charge_state == CHARGE_CV && (filt >> FILTER_SHIFT) < cfg_output.iterm) {
+		if (++below_count >= TERM_READINGS)
+			charge_end(CHARGE_DONE);
+	} else {
+		below_count = 0;
+	}
+}
+
+static const char * const charge_names[] = {
+	"IDLE", "CC", "CV", "DONE", "TIMEOUT", "ABORTED",
+};
+
+// "<state>,<mAh>,<seconds>,<filtered mA>"
+void charge_report(void)
+{
+	uint32_t until;
+
+	if (charge_state == CHARGE_IDLE)
+		until = start_time;
+	else if (charge_state == CHARGE_CC || charge_state == CHARGE_CV)
+		until = systick_now();
+	else
+		until = end_time;
+
+	uart_write_str(charge_names[charge_state]);
+	uart_write_ch(',');
+	if (energy.mah < start_mah)
+		start_mah = 0; // Counters were reset while charging
+	uart_write_int32(energy.mah - start_mah);
+	uart_write_ch(',');
+	uart_write_int32((until - start_time) / 1000);
+	uart_write_ch(',');
+	uart_write_int(filt >> FILTER_SHIFT);
+}
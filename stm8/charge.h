@@ -0,0 +1,41 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHARGE_H
+#define CHARGE_H
+
+#include <stdint.h>
+
+#define CHARGE_IDLE 0
+#define CHARGE_CC 1 // Charging, current limited
+#define CHARGE_CV 2 // Charging, voltage limited and tapering
+#define CHARGE_DONE 3 // Terminated on current
+#define CHARGE_TIMEOUT 4 // Terminated on time
+#define CHARGE_ABORTED 5 // Output turned off by someone else
+
+#if FEATURE_CHARGE
+void charge_start(void);
+void charge_stop(void);
+void charge_update(uint16_t cout);
+void charge_report(void);
+#else
+// Built without the charge mode, see FEATURES in the Makefile
+#define charge_update(cout)
+#endif
+
+#endif
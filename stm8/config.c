@@ -19,20 +19,59 @@
 #include "config.h"
 #include "eeprom.h"
 #include "fixedpoint.h"
+#include "stm8s.h"
 
 #include <string.h>
 
-#define SYSTEM_CONFIG ((cfg_system_t *)0x4000)
-#define OUTPUT_CONFIG ((cfg_output_t *)0x4040)
+/* The 128 bytes of data EEPROM:
+ *
+ *   0x4000-0x403E  system config (63 bytes), 0x403F is free
+ *   0x4040-0x406F  output journal, three 16 byte records, the event log copy
+ *                  is parked in one of them, see config_park_record()
+ *   0x4070-0x407F  energy counters, see energy.c
+ */
+#define SYSTEM_CONFIG ((cfg_system_t *)MEM(0x4000))
+#define OUTPUT_JOURNAL ((output_record_t *)MEM(0x4040))
+#define OUTPUT_SLOTS 3
 
-#define SYSTEM_CFG_VERSION 2
-#define OUTPUT_CFG_VERSION 1
+#define SYSTEM_CFG_VERSION 3
+#define OUTPUT_CFG_VERSION 2
 
 #define DEFAULT_NAME_STR "Unnamed"
 
-cfg_system_t default_cfg_system = {
+/* The output config is saved far more often than the system config, so rather
+ * than rewriting it in place it is appended round robin to a small journal of
+ * CRC protected records. The newest valid record, by sequence number, wins at
+ * boot and a torn write just leaves the previous one in charge.
+ */
+typedef struct {
+	uint8_t seq;
+	cfg_output_t cfg;
+	uint8_t flags; // OUTPUT_FLAG_*
+	uint8_t crc;
+} output_record_t; // 16 bytes
+
+/* The original firmware kept a single version 1 output config at 0x4040, it
+ * is imported once when the journal has nothing valid yet.
+ */
+typedef struct {
+	uint8_t version;
+	uint16_t vset;
+	uint16_t cset;
+	uint16_t vshutdown;
+	uint16_t cshutdown;
+} output_v1_t;
+
+#define OUTPUT_V1 ((output_v1_t *)MEM(0x4040))
+#define OUTPUT_V1_VERSION 1
+
+static uint8_t journal_slot; // Slot of the newest record
+static uint8_t journal_seq; // Sequence number of the newest record
+static uint8_t journal_flags; // Flags of the newest record
+
+const cfg_system_t default_cfg_system = {
 	.version = SYSTEM_CFG_VERSION,
-	.name = "Unnamed",
+	.name = DEFAULT_NAME_STR,
 	.default_on = 0,
 	.output = 0,
 	.autocommit = 1,
@@ -42,14 +81,19 @@ cfg_system_t default_cfg_system = {
 	.cout_adc = { .a = FLOAT_TO_FIXED(3.3*1.25/8.0), .b = FLOAT_TO_FIXED(200) },
 	.vout_pwm = { .a = FLOAT_TO_FIXED(8*0.073/3.3), .b = FLOAT_TO_FIXED(33) },
 	.cout_pwm = { .a = FLOAT_TO_FIXED(8*0.8/3.3), .b = FLOAT_TO_FIXED(160) },
+
+	.brightness = 8,
+	.blank_time = 0,
 };
 
-cfg_output_t default_cfg_output = {
+const cfg_output_t default_cfg_output = {
 	OUTPUT_CFG_VERSION,
 	5000, // 5V
 	500, // 0.5A
 	0,
 	0,
+	50, // 50mA
+	240, // 4 hours
 };
 
 void config_default_system(cfg_system_t *sys)
@@ -59,6 +103,13 @@ void config_default_system(cfg_system_t *sys)
 
 inline void validate_system_config(cfg_system_t *sys)
 {
+	// Version 3 appended the display settings, keep the calibration
+	if (sys->version == 2) {
+		sys->version = SYSTEM_CFG_VERSION;
+		sys->brightness = default_cfg_system.brightness;
+		sys->blank_time = default_cfg_system.blank_time;
+	}
+
 	if (sys->version != SYSTEM_CFG_VERSION ||
 			sys->name[0] == 0 ||
 			sys->vin_adc.a == 0 ||
@@ -69,8 +120,6 @@ inline void validate_system_config(cfg_system_t *sys)
 			)
 	{
 		config_default_system(sys);
-		// TODO: If we want easy upgradability we can implement it here to
-		// upgrade from an old struct to a new one.
 	}
 }
 
@@ -101,17 +150,154 @@ inline void validate_output_config(cfg_output_t *cfg)
 	}
 }
 
+static uint8_t crc8(uint8_t *p, uint8_t len)
+{
+	uint8_t crc = 0;
+	uint8_t i;
+
+	for (; len > 0; len--, p++) {
+		crc ^= *p;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	}
+
+	return crc;
+}
+
+#define RECORD_CRC_LEN (2 + sizeof(cfg_output_t))
+
 void config_load_output(cfg_output_t *cfg)
 {
 #if TEST
 	memset(cfg, 0, sizeof(*cfg));
 #else
-	memcpy(cfg, OUTPUT_CONFIG, sizeof(*cfg));
+	output_record_t *rec;
+	uint8_t found = 0;
+	uint8_t slot;
+
+	for (slot = 0, rec = OUTPUT_JOURNAL; slot < OUTPUT_SLOTS; slot++, rec++) {
+		if (rec->crc != crc8((uint8_t*)rec, RECORD_CRC_LEN) ||
+				rec->cfg.version != OUTPUT_CFG_VERSION)
+			continue;
+
+		if (!found || (int8_t)(rec->seq - journal_seq) > 0) {
+			found = 1;
+			journal_slot = slot;
+			journal_seq = rec->seq;
+		}
+	}
+
+	if (found) {
+		memcpy(cfg, &OUTPUT_JOURNAL[journal_slot].cfg, sizeof(*cfg));
+		journal_flags = OUTPUT_JOURNAL[journal_slot].flags;
+	} else {
+		memset(cfg, 0, sizeof(*cfg));
+		journal_slot = OUTPUT_SLOTS - 1; // First save goes to slot 0
+
+		if (OUTPUT_V1->version == OUTPUT_V1_VERSION && OUTPUT_V1->vset != 0 && OUTPUT_V1->cset != 0) {
+			config_default_output(cfg);
+			cfg->vset = OUTPUT_V1->vset;
+			cfg->cset = OUTPUT_V1->cset;
+			cfg->vshutdown = OUTPUT_V1->vshutdown;
+			cfg->cshutdown = OUTPUT_V1->cshutdown;
+			// Slot 0 takes its place, so this only happens once
+			config_save_output(cfg);
+		}
+	}
 #endif
 	validate_output_config(cfg);
 }
 
-void config_save_output(cfg_output_t *cfg)
+/* Saving is skipped when the newest record already holds the same config and
+ * the asynchronous writer only programs the words that differ from the stale
+ * record being replaced, so calling this after every change is cheap. The slot
+ * is taken as soon as the write is queued, should the write fail the CRC makes
+ * the next boot fall back to the record before it. While the newest record is
+ * still queued it is rewritten instead, so the journal has one write queued at
+ * most. The flags of the newest record carry over. Returns 0 when the writer
+ * is full and the save has to be tried again.
+ */
+uint8_t config_save_output(cfg_output_t *cfg)
+{
+	output_record_t rec;
+	output_record_t *newest;
+	uint8_t slot = journal_slot;
+	uint8_t seq = journal_seq;
+
+	newest = (output_record_t*)eeprom_pending((uint8_t*)&OUTPUT_JOURNAL[slot]);
+	if (!newest) {
+		newest = &OUTPUT_JOURNAL[slot];
+		slot++;
+		if (slot == OUTPUT_SLOTS)
+			slot = 0;
+		seq++;
+	}
+
+	if (memcmp(&newest->cfg, cfg, sizeof(*cfg)) == 0 && newest->flags == journal_flags)
+		return 1;
+
+	rec.seq = seq;
+	memcpy(&rec.cfg, cfg, sizeof(*cfg));
+	rec.flags = journal_flags;
+	rec.crc = crc8((uint8_t*)&rec, RECORD_CRC_LEN);
+
+	if (!eeprom_write_async((uint8_t*)&OUTPUT_JOURNAL[slot], (uint8_t*)&rec, sizeof(rec)))
+		return 0;
+
+	journal_slot = slot;
+	journal_seq = seq;
+	return 1;
+}
+
+uint8_t config_output_flags(void)
 {
-	eeprom_save_data((uint8_t*)OUTPUT_CONFIG, (uint8_t*)cfg, sizeof(*cfg));
+	return journal_flags;
 }
+
+// Saves right away when the flags change
+uint8_t config_set_output_flags(cfg_output_t *cfg, uint8_t flags)
+{
+	journal_flags = flags;
+	return config_save_output(cfg);
+}
+
+#if FEATURE_EVENTS
+/* Until the journal gets around to it, the slot it overwrites last holds the
+ * record before the newest, which is only there as a fallback for a torn
+ * write. Another 16 byte record can be parked in that slot instead. Its type
+ * takes the place of the config version, so the journal never mistakes it for
+ * one of its own records. A record of the same type already parked is
+ * replaced where it is, unless the journal has just taken that slot back.
+ */
+static uint8_t parked_slot(uint8_t type)
+{
+	uint8_t slot;
+
+	for (slot = 0; slot < OUTPUT_SLOTS; slot++) {
+		if (OUTPUT_JOURNAL[slot].cfg.version == type)
+			break;
+	}
+	return slot;
+}
+
+uint8_t config_park_record(uint8_t *rec)
+{
+	uint8_t slot = parked_slot(rec[1]);
+
+	if (slot == OUTPUT_SLOTS || slot == journal_slot) {
+		slot = journal_slot + OUTPUT_SLOTS - 1;
+		if (slot >= OUTPUT_SLOTS)
+			slot -= OUTPUT_SLOTS;
+	}
+
+	return eeprom_write_async((uint8_t*)&OUTPUT_JOURNAL[slot], rec, PARKED_RECORD_SIZE);
+}
+
+// The parked record of this type, 0 when there is none
+uint8_t *config_parked_record(uint8_t type)
+{
+	uint8_t slot = parked_slot(type);
+
+	return (slot < OUTPUT_SLOTS) ? (uint8_t*)&OUTPUT_JOURNAL[slot] : 0;
+}
+#endif
@@ -27,7 +27,9 @@ typedef struct {
 	uint16_t vset; // mV
 	uint16_t cset; // mA
 	uint16_t vshutdown; // mV
-	uint16_t cshutdown; // mA
+	uint16_t cshutdown; // Non-zero to shut down on entering CC (OCP)
+	uint16_t iterm; // mA, charge termination current
+	uint16_t charge_timeout; // minutes, 0 for no timeout
 } cfg_output_t;
 
 // These parameters correspond to the linear formula:
@@ -51,6 +53,9 @@ typedef struct {
 
 	calibrate_t vout_pwm;
 	calibrate_t cout_pwm;
+
+	uint8_t brightness; // 1-8, 8 is full duty
+	uint8_t blank_time; // sec without display changes before it blanks, 0 for never
 } cfg_system_t;
 
 typedef struct {
@@ -60,17 +65,36 @@ typedef struct {
 	uint16_t vin; // mV
 	uint16_t vout; // mV
 	uint16_t cout; // mA
-	uint8_t constant_current; // If false, we are in constant voltage
+	volatile uint8_t constant_current; // If false, we are in constant voltage
+	uint8_t fault; // Latched FAULT_* flags, cleared when the output is turned on
 #if DEBUG
 	uint8_t pc3;
 #endif
 } state_t;
 
+#define FAULT_OCP (1<<0) // Over current protection tripped on the TIM1 break input
+#define FAULT_POWERFAIL (1<<1) // Vin collapsed, the output was turned off
+
 void config_load_system(cfg_system_t *sys);
 void config_save_system(cfg_system_t *sys);
 void config_default_system(cfg_system_t *sys);
 void config_load_output(cfg_output_t *cfg);
-void config_save_output(cfg_output_t *cfg);
+uint8_t config_save_output(cfg_output_t *cfg);
 void config_default_output(cfg_output_t *cfg);
 
+// Kept with the output config in the journal
+#define OUTPUT_FLAG_RESTORE (1<<0) // The power failed with the output on, turn it back on at boot
+
+uint8_t config_output_flags(void);
+uint8_t config_set_output_flags(cfg_output_t *cfg, uint8_t flags);
+
+/* Records parked in the output journal are 16 bytes and keep their type in
+ * byte 1, see config_park_record()
+ */
+#define PARKED_RECORD_SIZE 16
+#define PARKED_TYPE_EVENTS 0xEE
+
+uint8_t config_park_record(uint8_t *rec);
+uint8_t *config_parked_record(uint8_t type);
+
 #endif
@@ -0,0 +1,134 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cvcc.h"
+#include "capture.h"
+#include "config.h"
+#include "outputs.h"
+#include "systick.h"
+#include "uart.h"
+#include "stm8s.h"
+
+extern cfg_system_t cfg_system;
+extern state_t state;
+
+// Must be a power of two
+#define CVCC_HISTORY 8
+
+typedef struct {
+	uint32_t time; // msec, from systick_now()
+	uint8_t cc; // Entered CC if true, CV otherwise
+} cvcc_event_t;
+
+static cvcc_event_t history[CVCC_HISTORY];
+static uint16_t history_count; // Transitions ever recorded, the next one goes to history_count % CVCC_HISTORY
+static uint16_t cc_count;
+static uint16_t cv_count;
+
+static uint16_t dump_next; // History count of the next entry to report
+static uint8_t dump_left;
+
+#define DUMP_ROOM 16 // Free output buffer needed for one entry
+
+void cvcc_init(void)
+{
+	state.constant_current = (PB_IDR & (1<<5)) ? 1 : 0;
+
+	// PB5 is the CV/CC sense line, interrupt on both edges
+	EXTI_CR1 = (EXTI_CR1 & ~EXTI_CR1_PBIS_MASK) | EXTI_CR1_PBIS_BOTH;
+	PB_CR2 |= (1<<5);
+}
+
+static void cvcc_record(uint32_t now, uint8_t cc)
+{
+	cvcc_event_t *ev = &history[history_count & (CVCC_HISTORY-1)];
+
+	ev->time = now;
+	ev->cc = cc;
+	history_count++;
+
+	if (cc)
+		cc_count++;
+	else
+		cv_count++;
+}
+
+void cvcc_isr(void) INTERRUPT(EXTI_PORTB_IRQ)
+{
+	uint8_t cc = (PB_IDR & (1<<5)) ? 1 : 0;
+	uint32_t now = systick_now();
+
+	if (cc == state.constant_current) {
+		// The line went and came back before we could read it, a short
+		// excursion still counts as two transitions.
+		cvcc_record(now, !cc);
+	}
+	cvcc_record(now, cc);
+	if (cc)
+		capture_event(CAPTURE_ON_CC);
+
+	state.constant_current = cc;
+	output_check_state(&cfg_system, cc);
+}
+
+/* Starts "<now>,<cc count>,<cv count>", the recorded transitions follow
+ * oldest first from cvcc_drive() as the output buffer drains, one "<time>,CC"
+ * or "<time>,CV" per line.
+ */
+void cvcc_report(void)
+{
+	uint16_t count;
+	uint16_t cc, cv;
+
+	disable_interrupts();
+	count = history_count;
+	cc = cc_count;
+	cv = cv_count;
+	enable_interrupts();
+
+	dump_left = count < CVCC_HISTORY ? count : CVCC_HISTORY;
+	dump_next = count - dump_left;
+
+	uart_write_int32(systick_now());
+	uart_write_ch(',');
+	uart_write_int(cc);
+	uart_write_ch(',');
+	uart_write_int(cv);
+}
+
+void cvcc_drive(void)
+{
+	cvcc_event_t ev;
+
+	if (!dump_left || uart_write_room() < DUMP_ROOM)
+		return;
+
+	disable_interrupts();
+	// Entries overwritten since the dump started are skipped
+	if ((uint16_t)(history_count - dump_next) > CVCC_HISTORY)
+		dump_next = history_count - CVCC_HISTORY;
+	ev = history[dump_next & (CVCC_HISTORY-1)];
+	enable_interrupts();
+
+	uart_write_str("\r\n");
+	uart_write_int32(ev.time);
+	uart_write_str(ev.cc ? ",CC" : ",CV");
+
+	dump_next++;
+	dump_left--;
+}
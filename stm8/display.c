@@ -19,15 +19,44 @@
  */
 
 #include "display.h"
+#include "config.h"
+#include "systick.h"
+#include "uart.h"
 #include "stm8s.h"
 
 #include <string.h>
 
-uint8_t display_idx;
+#define DIGITS 4
+#define FRAME_BITS 16
+#define DISPLAY_HOLD 500 // msec between updates of the shown value
+
 uint8_t display_data[4];
 uint8_t pending_display_data[4];
 uint8_t pending_update;
-uint16_t timer;
+static uint32_t hold_until;
+
+/* The display is multiplexed from the 1 kHz systick interrupt, one digit per
+ * tick. Each digit is kept as the sequence of PD_ODR values that shift its 16
+ * bits into the 74HC595 pair, so the interrupt only copies bytes to the port
+ * and pulses the clock. PD4 is the only output on port D driven through ODR,
+ * the UART pins are under peripheral control and PD1 is an input, so writing
+ * the whole register is safe.
+ */
+static uint8_t frame[DIGITS][FRAME_BITS];
+static uint8_t display_idx;
+
+// Multiplex statistics, latched once per second
+static uint16_t stat_ticks;
+static uint8_t stat_frames;
+static uint16_t stat_busy; // TIM4 counts, 4 usec each
+static uint8_t display_rate;
+static uint16_t display_busy;
+
+// Rendering cache, see display_measurement()
+static uint8_t display_select = DISPLAY_VOUT;
+static uint8_t display_shown = 0xFF; // Quantity on the display, 0xFF to force a render
+static uint16_t display_last; // Value it was rendered from
+static uint32_t display_cycle_time;
 
 static const uint8_t display_number[10] = {
 	0xFC, // '0'
@@ -48,50 +77,191 @@ static const uint8_t display_number[10] = {
 #define D2	100
 #define D1	10
 
-#define SET_DATA(bit) do { if (bit) { PD_ODR |= (1<<4); } else { PD_ODR &= ~(1<<4); }} while (0)
-#define PULSE_CLOCK() do { PA_ODR |= (1<<1); PA_ODR &= ~(1<<1); } while (0)
+#define DATA_BIT (1<<4)
+#define SHIFT_BIT(n) do { PD_ODR = f[n]; PA_ODR |= (1<<1); PA_ODR &= ~(1<<1); } while (0)
 #define SAVE_DATA() do { PA_ODR &= ~(1<<2); PA_ODR |= (1<<2); } while (0)
 
-
-
-inline void display_word(uint16_t word)
+static void display_build(uint8_t i, uint8_t data)
 {
-	uint8_t i;
+	uint16_t word = (0xFF00 ^ (3 << (8+(i*2)))) | data;
+	uint8_t *f = frame[i];
+	uint8_t bit;
 
-	for (i = 0; i < 16; i++) {
-		uint8_t bit = word & 1;
+	// The 74HC595s take the least significant bit first
+	for (bit = 0; bit < FRAME_BITS; bit++) {
+		f[bit] = (word & 1) ? DATA_BIT : 0;
 		word >>= 1;
-		SET_DATA(bit);
-		PULSE_CLOCK();
 	}
+}
+
+/* Brightness blanks the display for the tail of every frame. TIM4 runs with a
+ * preloaded reload value and below full brightness each digit gets a lit phase
+ * and the frame ends in one blank phase per digit, every lit and blank pair is
+ * SLOT_COUNTS long and counts as one msec. The blank frame is only shifted out
+ * by the first blank phase, the rest of them just keep time. At full
+ * brightness there is no blank phase and the interrupt rate stays at 1 kHz.
+ */
+#define SLOT_COUNTS 250 // TIM4 counts per msec
+#define BRIGHTNESS_MAX 8
+
+/* No segments but every digit line selected, so the buttons on the digit
+ * lines can still be read while the display is blank.
+ */
+static const uint8_t blank_frame[FRAME_BITS] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static volatile uint8_t blank_counts; // Length of the blank phase
+static uint8_t display_phase; // Blank phases left in this frame
+static uint8_t display_blanked; // The 74HC595s hold blank_frame
+static volatile uint8_t display_dark; // Auto-blanked
+
+static uint8_t blank_time; // sec, 0 to never auto-blank
+static uint32_t last_change;
+
+static void display_shift(const uint8_t *f)
+{
+	SHIFT_BIT(0); SHIFT_BIT(1); SHIFT_BIT(2); SHIFT_BIT(3);
+	SHIFT_BIT(4); SHIFT_BIT(5); SHIFT_BIT(6); SHIFT_BIT(7);
+	SHIFT_BIT(8); SHIFT_BIT(9); SHIFT_BIT(10); SHIFT_BIT(11);
+	SHIFT_BIT(12); SHIFT_BIT(13); SHIFT_BIT(14); SHIFT_BIT(15);
 	SAVE_DATA();
 }
 
+/* Called from the TIM4 update interrupt, returns true when a msec went by so
+ * the caller can keep time across the blank phases. The reload value written
+ * here is for the phase after the one that starts now.
+ */
+uint8_t display_multiplex(void)
+{
+	uint8_t start = TIM4_CNTR;
+	uint8_t blank = blank_counts;
+
+	if (display_phase) {
+		if (!display_blanked) {
+			display_shift(blank_frame);
+			display_blanked = 1;
+		}
+
+		// The frame goes on blank until every digit had its share
+		if (--display_phase && blank)
+			TIM4_ARR = blank - 1;
+		else {
+			display_phase = 0;
+			TIM4_ARR = SLOT_COUNTS - 1 - blank;
+		}
+		stat_busy += (uint8_t)(TIM4_CNTR - start);
+		return 1;
+	}
+
+	if (display_dark) {
+		if (!display_blanked) {
+			display_shift(blank_frame);
+			display_blanked = 1;
+		}
+	} else {
+		display_shift(frame[display_idx]);
+		display_blanked = 0;
+	}
+
+	display_idx = (display_idx + 1) & (DIGITS - 1);
+	if (display_idx == 0) {
+		stat_frames++;
+		if (blank)
+			display_phase = DIGITS;
+	}
+
+	TIM4_ARR = display_phase ? blank - 1 : SLOT_COUNTS - 1 - blank;
+
+	stat_busy += (uint8_t)(TIM4_CNTR - start);
+	if (++stat_ticks == 1000) {
+		display_rate = stat_frames;
+		display_busy = stat_busy;
+		stat_ticks = 0;
+		stat_frames = 0;
+		stat_busy = 0;
+	}
+
+	return !blank;
+}
+
+// 1 is the dimmest and BRIGHTNESS_MAX is full duty
+void display_brightness(uint8_t level)
+{
+	if (level == 0)
+		level = 1;
+	if (level > BRIGHTNESS_MAX)
+		level = BRIGHTNESS_MAX;
+
+	blank_counts = SLOT_COUNTS - (uint8_t)((level * SLOT_COUNTS) / BRIGHTNESS_MAX);
+}
+
+// Blank the display after sec without changes, 0 disables it
+void display_blank_time(uint8_t sec)
+{
+	blank_time = sec;
+	display_wake();
+}
+
+void display_wake(void)
+{
+	last_change = systick_now();
+	display_dark = 0;
+}
+
+uint8_t display_is_dark(void)
+{
+	return display_dark;
+}
+
+/* Moves a pending value to the frames, at most once per DISPLAY_HOLD, and
+ * blanks the display once nothing changed for blank_time.
+ */
 void display_refresh(void)
 {
-	uint8_t i = display_idx++;
-	uint8_t bit = 8+(i*2);
-	uint16_t digit = 0xFF00 ^ (3<<bit);
-	
-	//uint16_t digit=(~(0x03<<(2*i)))<<8;
-	//uint8_t digit[4]={0xFC,0xF3,0xCF,0x3F};
-
-	if (timer > 0)
-		timer--;
-	
-	if (pending_update && timer == 0) {
-		memcpy(display_data, pending_display_data, sizeof(display_data));
+	uint32_t now;
+	uint8_t i;
+
+	if (!pending_update && !blank_time)
+		return;
+
+	now = systick_now();
+
+	if (pending_update && (int32_t)(now - hold_until) >= 0) {
 		pending_update = 0;
-		timer = 1500; // 1/2 of a second, approximately
-	}
-	
+		hold_until = now + DISPLAY_HOLD;
 
-	display_word(digit | display_data[i]);
+		if (memcmp(display_data, pending_display_data, sizeof(display_data)) != 0) {
+			memcpy(display_data, pending_display_data, sizeof(display_data));
+			for (i = 0; i < DIGITS; i++)
+				display_build(i, display_data[i]);
+			last_change = now;
+			display_dark = 0;
+		}
+	}
 
-	if (display_idx == 4)
-		display_idx = 0;
+	if (blank_time && !display_dark && now - last_change >= blank_time * 1000UL)
+		display_dark = 1;
 }
 
+/* "<frames per second>,<usec per second>,<quantity>" the time is spent
+ * shifting out digits in the interrupt, interrupt entry and exit are not
+ * included.
+ */
+void display_report(void)
+{
+	uint16_t busy;
+
+	disable_interrupts();
+	busy = display_busy;
+	enable_interrupts();
+
+	uart_write_int(display_rate);
+	uart_write_ch(',');
+	uart_write_int32((uint32_t)busy * 4);
+	uart_write_ch(',');
+	uart_write_int(display_select);
+}
 
 uint8_t display_char(uint8_t ch, uint8_t dot)
 {
@@ -114,45 +284,180 @@ void display_show_raw_digits(uint8_t ch1, uint8_t ch2, uint8_t ch3, uint8_t ch4
 	pending_update = 1;
 }
 
-void display_show(uint8_t ch1, uint8_t dot1, uint8_t ch2, uint8_t dot2, uint8_t ch3, uint8_t dot3, uint8_t ch4, uint8_t dot4)
+static const uint16_t powers_of_ten[4] = { D4, D3, D2, D1 };
+
+/* Splits value into its five decimal digits, most significant first, by
+ * repeated subtraction. At most 9 subtractions per digit, no division.
+ */
+static void uint16_to_digits(uint16_t value, uint8_t *digits)
 {
-  /*	pending_display_data[3] = display_char(ch1, dot1);
-	pending_display_data[2] = display_char(ch2, dot2);
-	pending_display_data[1] = display_char(ch3, dot3);
-	pending_display_data[0] = display_char(ch4, dot4);*/
+	uint8_t i;
+	uint8_t d;
 
-  display_show_raw_digits(display_char(ch1,dot1),
-			  display_char(ch2,dot2),
-			  display_char(ch3,dot3),
-			  display_char(ch4,dot4));
+	for (i = 0; i < 4; i++) {
+		uint16_t p = powers_of_ten[i];
+
+		for (d = '0'; value >= p; d++)
+			value -= p;
+		digits[i] = d;
+	}
+	digits[4] = '0' + value;
 }
 
-uint8_t uint16_to_digit(uint16_t value, uint16_t devider)
+/* Shows three of the five digits of value after the symbol what, starting at
+ * digit first with the dot after digit dot. A leading zero is blanked unless
+ * it carries the dot.
+ */
+static void display_digits(uint8_t what, uint16_t value, uint8_t first, uint8_t dot)
 {
-  return '0'+(value / devider) % 10;
-}
+	uint8_t digits[5];
+	uint8_t ch2;
 
+	uint16_to_digits(value, digits);
+
+	ch2 = digits[first];
+	if (ch2 == '0' && first != dot)
+		ch2 = 0;
+
+	// what is a segment pattern and could alias a digit in display_char()
+	display_show_raw_digits(what,
+			display_char(ch2, first == dot),
+			display_char(digits[first+1], first+1 == dot),
+			display_char(digits[first+2], first+2 == dot));
+}
 
 // Displays the cfg_output_t uint16_t values
 void display_show_uint16(uint8_t what, uint16_t value)
 {
-  uint8_t ch1;
-  uint8_t ch2;
-  uint8_t ch3;
-  uint8_t ch4;
-  
-  /*
-    ch1 = uint16_to_digit(value, D4);
-    ch2 = uint16_to_digit(value, D3);
-    ch3 = uint16_to_digit(value, D2);
-    ch4 = uint16_to_digit(value, D1);
-  */
-
-  ch2 = uint16_to_digit(value, D4);
-  if (ch2=='0')
-    ch2=0x0;
-  ch3 = uint16_to_digit(value, D3);
-  ch4 = uint16_to_digit(value, D2);
-
-  display_show(what, 0, ch2, 0, ch3, 1, ch4, 0);
+	display_digits(what, value, 0, 1);
+}
+
+/* Only the selected quantity is rendered and only when it moved by more than
+ * DISPLAY_BAND of the last shown digit since it was last rendered, so noise
+ * around a digit boundary does not make the last digit jitter. Values are
+ * rounded to the shown resolution.
+ */
+#define DISPLAY_BAND(lsb) ((lsb) - ((lsb) >> 2)) // 3/4 of a digit
+#define DISPLAY_CYCLE_TIME 3000 // msec per quantity when cycling
+
+#define SYM_U 0x7C
+#define SYM_A 0xEE
+#define SYM_P 0xCE
+#define SYM_u 0x38
+
+
+void display_quantity(uint8_t quantity)
+{
+	if (quantity > DISPLAY_CYCLE)
+		return;
+
+	display_select = quantity;
+	display_invalidate();
+}
+
+// 10mW units, vout*cout/10000 as a multiply by 2^26/10000 and shifts
+static uint16_t display_power(uint16_t vout, uint16_t cout)
+{
+	uint32_t vi = ((uint32_t)vout * cout) >> 10;
+
+	return (vi * 6711) >> 16;
+}
+
+static uint16_t display_lsb(uint8_t quantity, uint16_t value)
+{
+	switch (quantity) {
+		case DISPLAY_IOUT:
+			return 10;
+		case DISPLAY_POWER:
+			return (value >= 9995) ? 100 : 10;
+		default:
+			return 100;
+	}
+}
+
+/* Shows value as quantity, rounded to the shown resolution. Vout and Vin are
+ * in mV, Iout in mA and power in 10mW.
+ */
+void display_value(uint8_t quantity, uint16_t value)
+{
+	uint16_t lsb = display_lsb(quantity, value);
+
+	if (value < 0xFFFF - (lsb >> 1))
+		value += lsb >> 1;
+
+	switch (quantity) {
+		case DISPLAY_IOUT:
+			display_digits(SYM_A, value, 1, 1); // X.XX A
+			break;
+		case DISPLAY_POWER:
+			if (lsb == 100)
+				display_digits(SYM_P, value, 0, 2); // XXX. W
+			else
+				display_digits(SYM_P, value, 1, 2); // XX.X W
+			break;
+		case DISPLAY_VIN:
+			display_digits(SYM_u, value, 0, 1); // XX.X V
+			break;
+		default:
+			display_digits(SYM_U, value, 0, 1); // XX.X V
+			break;
+	}
+}
+
+// The next measurement is rendered whether it changed or not
+void display_invalidate(void)
+{
+	display_shown = 0xFF;
+}
+
+// Show the pending value without waiting for DISPLAY_HOLD
+void display_immediate(void)
+{
+	hold_until = systick_now();
+}
+
+// Called once per round of ADC readings
+void display_measurement(state_t *st)
+{
+	uint8_t quantity = display_select;
+	uint16_t value;
+	uint16_t lsb;
+
+	if (quantity == DISPLAY_CYCLE) {
+		uint32_t now = systick_now();
+
+		quantity = display_shown;
+		if (quantity >= DISPLAY_CYCLE) {
+			quantity = DISPLAY_VOUT;
+			display_cycle_time = now;
+		} else if (now - display_cycle_time >= DISPLAY_CYCLE_TIME) {
+			quantity = (quantity + 1) & 3;
+			display_cycle_time = now;
+		}
+	}
+
+	switch (quantity) {
+		case DISPLAY_IOUT:
+			value = st->cout;
+			break;
+		case DISPLAY_POWER:
+			value = display_power(st->vout, st->cout);
+			break;
+		case DISPLAY_VIN:
+			value = st->vin;
+			break;
+		default:
+			value = st->vout;
+			break;
+	}
+	lsb = display_lsb(quantity, value);
+
+	if (quantity == display_shown &&
+			value < display_last + DISPLAY_BAND(lsb) &&
+			value + DISPLAY_BAND(lsb) > display_last)
+		return;
+
+	display_shown = quantity;
+	display_last = value;
+	display_value(quantity, value);
 }
@@ -17,8 +17,26 @@
  */
 
 #include <stdint.h>
+#include "config.h"
+
+// Quantities for display_quantity()
+#define DISPLAY_VOUT 0
+#define DISPLAY_IOUT 1
+#define DISPLAY_POWER 2
+#define DISPLAY_VIN 3
+#define DISPLAY_CYCLE 4 // Each of the above in turn
 
 void display_refresh(void);
-void display_show(uint8_t ch1, uint8_t dot1, uint8_t ch2, uint8_t dot2, uint8_t ch3, uint8_t dot3, uint8_t ch4, uint8_t dot4);
+uint8_t display_multiplex(void);
+void display_report(void);
 void display_show_uint16(uint8_t what,uint16_t value);
 void display_show_raw_digits(uint8_t ch1, uint8_t ch2, uint8_t ch3, uint8_t ch4 );
+void display_quantity(uint8_t quantity);
+void display_measurement(state_t *st);
+void display_brightness(uint8_t level);
+void display_blank_time(uint8_t sec);
+void display_wake(void);
+uint8_t display_is_dark(void);
+void display_value(uint8_t quantity, uint16_t value);
+void display_invalidate(void);
+void display_immediate(void);
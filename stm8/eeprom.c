@@ -17,6 +17,7 @@
  */
 
 #include "eeprom.h"
+#include "event.h"
 #include "stm8s.h"
 
 static uint8_t eeprom_unlock_data(void)
@@ -32,19 +33,21 @@ inline void eeprom_lock(void)
 	FLASH_IAPSR &= ~FLASH_IAPSR_DUL;
 }
 
-uint8_t eeprom_set_afr0(void)
+uint8_t eeprom_set_afr(uint8_t afr)
 {
 	uint8_t sr;
 	uint16_t timeout = 0xFFFF;
 
+	eeprom_flush();
+
 	if (!eeprom_unlock_data())
 		return 0;
 
 	FLASH_CR2 = FLASH_CR2_OPT;// Set the OPT bit
-	FLASH_NCR2 = ~FLASH_NCR2_NOPT; // Remove the NOPT bit
+	FLASH_NCR2 = (uint8_t)~FLASH_NCR2_NOPT; // Remove the NOPT bit
 
-	OPT2 = 1;
-	NOPT2 = 0xFE;
+	OPT2 = afr;
+	NOPT2 = ~afr;
 	for (timeout = 0xFFFF; timeout > 0; timeout--) {
 		sr = FLASH_IAPSR;
 		if (sr & FLASH_IAPSR_EOP)
@@ -57,22 +60,34 @@ uint8_t eeprom_set_afr0(void)
 	FLASH_CR2 &= FLASH_CR2_OPT;
 	FLASH_NCR2 |= FLASH_NCR2_NOPT;
 	eeprom_lock();
-	return (timeout > 0) && (OPT2 & 1);
+	return (timeout > 0) && ((OPT2 & afr) == afr);
 }
 
 uint8_t eeprom_save_data(uint8_t *dst, uint8_t *src, uint8_t len)
 {
 	uint16_t timeout;
 	uint8_t sr;
+	uint8_t written = 0;
+
+	eeprom_flush();
 
 	if (!eeprom_unlock_data())
 		return 0;
 
+	// Only program the bytes that actually change
 	for (; len > 0; len--, dst++, src++) {
-		*dst = *src;
+		if (*dst != *src) {
+			*dst = *src;
+			written = 1;
+		}
 		IWDG_KR = 0xAA; // Reset the counter
 	}
 
+	if (!written) {
+		eeprom_lock();
+		return 1;
+	}
+
 	for (timeout = 0xFFFF; timeout > 0; timeout--) {
 		IWDG_KR = 0xAA; // Reset the counter
 		sr = FLASH_IAPSR;
@@ -86,3 +101,187 @@ uint8_t eeprom_save_data(uint8_t *dst, uint8_t *src, uint8_t len)
 	eeprom_lock();
 	return (timeout > 0);
 }
+
+/* Asynchronous writer: a short queue of jobs that eeprom_drive() advances one
+ * program operation at a time from the main loop. Aligned runs of four bytes
+ * use word programming so a 16 byte record takes four program cycles instead
+ * of sixteen, and words or bytes that already hold the right data are skipped.
+ * A write to an address that already has a job replaces the data of that job,
+ * starting over if it is being programmed, so there is never more than one job
+ * per record and the queue has room for the output journal, the energy
+ * counters and the event log copy at once.
+ */
+#define EEPROM_QUEUE 3
+
+typedef struct {
+	uint8_t *dst;
+	uint8_t len;
+	uint8_t buf[EEPROM_ASYNC_MAX];
+} eeprom_job_t;
+
+static eeprom_job_t jobs[EEPROM_QUEUE];
+static uint8_t job_head; // Job being programmed
+static uint8_t job_count;
+static uint8_t job_pos;
+static uint8_t job_status; // Of the last job once the queue is empty
+static uint8_t job_programming;
+static uint16_t job_wait;
+static uint16_t job_failures;
+
+#define JOB_TIMEOUT 0xFFFF // eeprom_drive() calls
+
+static uint8_t job_next(uint8_t i)
+{
+	return (i == EEPROM_QUEUE-1) ? 0 : i + 1;
+}
+
+static eeprom_job_t *job_find(uint8_t *dst)
+{
+	uint8_t i, n;
+
+	for (i = job_head, n = job_count; n > 0; i = job_next(i), n--) {
+		if (jobs[i].dst == dst)
+			return &jobs[i];
+	}
+	return 0;
+}
+
+static void job_failed(void)
+{
+	job_status = EEPROM_FAILED;
+	job_failures++;
+	event_log(EVENT_EEPROM, job_failures);
+}
+
+// Returns 0 when the queue is full, the caller tries again later
+uint8_t eeprom_write_async(uint8_t *dst, uint8_t *src, uint8_t len)
+{
+	eeprom_job_t *job;
+	uint8_t i;
+
+	if (len > EEPROM_ASYNC_MAX)
+		return 0;
+
+	job = job_find(dst);
+	if (!job) {
+		if (job_count == EEPROM_QUEUE)
+			return 0;
+
+		if (job_count == 0 && !eeprom_unlock_data()) {
+			job_failed();
+			return 0;
+		}
+
+		i = job_head + job_count;
+		if (i >= EEPROM_QUEUE)
+			i -= EEPROM_QUEUE;
+		job = &jobs[i];
+		job_count++;
+	} else if (job == &jobs[job_head]) {
+		job_pos = 0; // Start over, what is already written gets skipped
+	}
+
+	for (i = 0; i < len; i++)
+		job->buf[i] = src[i];
+	job->dst = dst;
+	job->len = len;
+	return 1;
+}
+
+// The data still to be written to dst, 0 when nothing is queued for it
+uint8_t *eeprom_pending(uint8_t *dst)
+{
+	eeprom_job_t *job = job_find(dst);
+
+	return job ? job->buf : 0;
+}
+
+static void eeprom_job_end(uint8_t status)
+{
+	if (status == EEPROM_FAILED)
+		job_failed();
+	else
+		job_status = status;
+
+	job_head = job_next(job_head);
+	job_pos = 0;
+	job_programming = 0;
+	if (--job_count == 0)
+		eeprom_lock();
+}
+
+void eeprom_drive(void)
+{
+	eeprom_job_t *job = &jobs[job_head];
+	uint8_t *dst;
+	uint8_t *src;
+	uint8_t sr;
+
+	if (job_count == 0)
+		return;
+
+	if (job_programming) {
+		sr = FLASH_IAPSR; // Reading clears EOP
+		if (sr & FLASH_IAPSR_WR_PG_DIS) {
+			eeprom_job_end(EEPROM_FAILED);
+			return;
+		}
+		if (!(sr & FLASH_IAPSR_EOP)) {
+			if (--job_wait == 0)
+				eeprom_job_end(EEPROM_FAILED);
+			return;
+		}
+		job_programming = 0;
+	}
+
+	// Start the next operation that actually changes something
+	while (job_pos < job->len) {
+		dst = job->dst + job_pos;
+		src = job->buf + job_pos;
+
+		if ((((uintptr_t)dst & 3) == 0) && job->len - job_pos >= 4) {
+			job_pos += 4;
+			if (dst[0] == src[0] && dst[1] == src[1] && dst[2] == src[2] && dst[3] == src[3])
+				continue;
+
+			FLASH_CR2 = FLASH_CR2_WPRG;
+			FLASH_NCR2 = (uint8_t)~FLASH_NCR2_NWPRG;
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = src[3];
+		} else {
+			job_pos++;
+			if (*dst == *src)
+				continue;
+
+			*dst = *src;
+		}
+
+		job_programming = 1;
+		job_wait = JOB_TIMEOUT;
+		return;
+	}
+
+	eeprom_job_end(EEPROM_DONE);
+}
+
+void eeprom_flush(void)
+{
+	while (job_count > 0) {
+		IWDG_KR = 0xAA; // Reset the counter
+		eeprom_drive();
+	}
+}
+
+uint8_t eeprom_status(void)
+{
+	if (job_count > 0)
+		return EEPROM_BUSY;
+	return job_status;
+}
+
+uint16_t eeprom_failures(void)
+{
+	return job_failures;
+}
@@ -18,5 +18,19 @@
 
 #include <stdint.h>
 
-uint8_t eeprom_set_afr0(void);
+uint8_t eeprom_set_afr(uint8_t afr);
 uint8_t eeprom_save_data(uint8_t *dst, uint8_t *src, uint8_t len);
+
+#define EEPROM_IDLE 0
+#define EEPROM_BUSY 1
+#define EEPROM_DONE 2
+#define EEPROM_FAILED 3
+
+#define EEPROM_ASYNC_MAX 16 // Largest asynchronous write, one journal record
+
+uint8_t eeprom_write_async(uint8_t *dst, uint8_t *src, uint8_t len);
+uint8_t *eeprom_pending(uint8_t *dst);
+void eeprom_drive(void);
+void eeprom_flush(void);
+uint8_t eeprom_status(void);
+uint16_t eeprom_failures(void);
@@ -0,0 +1,190 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "energy.h"
+#include "eeprom.h"
+#include "systick.h"
+#include "uart.h"
+#include "stm8s.h"
+
+#include <string.h>
+
+/* The counters live in the last 16 bytes of the data EEPROM, see the map in
+ * config.c.
+ */
+#define ENERGY_RECORD ((energy_record_t *)MEM(0x4070))
+#define ENERGY_RECORD_VERSION 2
+
+#define ENERGY_FLAG_PERSIST (1<<0)
+#define ENERGY_FLAG_SNAPSHOT (1<<1) // Written by energy_snapshot() on power failure
+
+// Exactly 16 bytes so it is written as four words
+typedef struct {
+	uint8_t version;
+	uint8_t flags;
+	energy_t counters;
+	uint8_t reserved;
+	uint8_t check;
+} energy_record_t;
+
+/* Power is accumulated in units of 16uW*msec so that a full scale sample
+ * (35V * 3A) over a clamped 255 msec step still fits comfortably in 32 bits
+ * on top of a remainder below one mWh.
+ */
+#define POWER_SHIFT 4
+#define ENERGY_UNIT (3600000000UL >> POWER_SHIFT) // 1 mWh
+#define CHARGE_UNIT 3600000UL // 1 mAh in mA*msec
+#define MAX_STEP 255 // msec
+
+energy_t energy;
+
+static uint32_t energy_frac;
+static uint32_t charge_frac;
+static uint16_t seconds_frac;
+static uint32_t last_update;
+static uint8_t flags;
+
+static uint8_t energy_check(energy_record_t *rec)
+{
+	uint8_t *p = (uint8_t *)rec;
+	uint8_t sum = 0xA5;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(*rec) - 1; i++)
+		sum += p[i];
+
+	return sum;
+}
+
+/* A power failure snapshot always restores the counters and is then turned
+ * back into a regular record so it is only acted upon once.
+ */
+void energy_load(void)
+{
+	energy_record_t rec;
+
+#if TEST
+	memset(&rec, 0, sizeof(rec));
+#else
+	memcpy(&rec, ENERGY_RECORD, sizeof(rec));
+#endif
+	if (rec.version != ENERGY_RECORD_VERSION || rec.check != energy_check(&rec))
+		return;
+
+	flags = rec.flags & ENERGY_FLAG_PERSIST;
+	if (rec.flags & (ENERGY_FLAG_PERSIST | ENERGY_FLAG_SNAPSHOT))
+		energy = rec.counters;
+
+	if (rec.flags & ENERGY_FLAG_SNAPSHOT)
+		energy_save();
+}
+
+static void energy_fill(energy_record_t *rec, uint8_t rec_flags)
+{
+	rec->version = ENERGY_RECORD_VERSION;
+	rec->flags = rec_flags;
+	rec->counters = energy;
+	rec->reserved = 0xFF;
+	rec->check = energy_check(rec);
+}
+
+void energy_save(void)
+{
+	energy_record_t rec;
+
+	energy_fill(&rec, flags);
+	eeprom_write_async((uint8_t*)ENERGY_RECORD, (uint8_t*)&rec, sizeof(rec));
+}
+
+// Queued like energy_save(), the caller flushes once the other records are in
+void energy_snapshot(void)
+{
+	energy_record_t rec;
+
+	energy_fill(&rec, flags | ENERGY_FLAG_SNAPSHOT);
+	eeprom_write_async((uint8_t*)ENERGY_RECORD, (uint8_t*)&rec, sizeof(rec));
+}
+
+void energy_reset(void)
+{
+	memset(&energy, 0, sizeof(energy));
+	energy_frac = 0;
+	charge_frac = 0;
+	seconds_frac = 0;
+
+	if (flags & ENERGY_FLAG_PERSIST)
+		energy_save();
+}
+
+void energy_persist(uint8_t enable)
+{
+	if (enable)
+		flags |= ENERGY_FLAG_PERSIST;
+	else
+		flags &= ~ENERGY_FLAG_PERSIST;
+
+	energy_save();
+}
+
+// Called for every new current reading, vout is the latest reading as well
+void energy_update(uint16_t vout, uint16_t cout, uint8_t output)
+{
+	uint32_t now = systick_now();
+	uint32_t step = now - last_update;
+	uint8_t dt;
+
+	last_update = now;
+	if (!output)
+		return;
+
+	dt = (step > MAX_STEP) ? MAX_STEP : step;
+
+	energy_frac += ((((uint32_t)vout * cout) + (1<<(POWER_SHIFT-1))) >> POWER_SHIFT) * dt;
+	while (energy_frac >= ENERGY_UNIT) {
+		energy_frac -= ENERGY_UNIT;
+		energy.mwh++;
+	}
+
+	charge_frac += (uint32_t)cout * dt;
+	while (charge_frac >= CHARGE_UNIT) {
+		charge_frac -= CHARGE_UNIT;
+		energy.mah++;
+	}
+
+	seconds_frac += dt;
+	while (seconds_frac >= 1000) {
+		seconds_frac -= 1000;
+		energy.seconds++;
+	}
+}
+
+void energy_output_off(void)
+{
+	if (flags & ENERGY_FLAG_PERSIST)
+		energy_save();
+}
+
+// "<mWh>,<mAh>,<seconds>"
+void energy_report(void)
+{
+	uart_write_int32(energy.mwh);
+	uart_write_ch(',');
+	uart_write_int32(energy.mah);
+	uart_write_ch(',');
+	uart_write_int32(energy.seconds);
+}
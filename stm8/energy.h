@@ -0,0 +1,50 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t mwh; // Energy delivered, mWh
+	uint32_t mah; // Charge delivered, mAh
+	uint32_t seconds; // Time with the output on
+} energy_t;
+
+#if FEATURE_ENERGY
+extern energy_t energy;
+
+void energy_load(void);
+void energy_save(void);
+void energy_snapshot(void);
+void energy_reset(void);
+void energy_persist(uint8_t enable);
+void energy_update(uint16_t vout, uint16_t cout, uint8_t output);
+void energy_output_off(void);
+void energy_report(void);
+#else
+// Built without the energy counters, see FEATURES in the Makefile
+#define energy_load()
+#define energy_save()
+#define energy_snapshot()
+#define energy_update(vout, cout, output)
+#define energy_output_off()
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "event.h"
+#include "config.h"
+#include "systick.h"
+#include "uart.h"
+#include "stm8s.h"
+
+extern state_t state;
+
+/* The log lives in RAM and only ever gets written from the main loop, events
+ * from interrupt handlers are picked up from the state they leave behind. On
+ * fatal events the newest entries are parked in the output journal in data
+ * EEPROM, see config_park_record(), and put back in the log at the next boot.
+ */
+#define EVENT_LOG 16 // Entries, must be a power of two
+#define EVENT_KEEP 2 // Entries saved to EEPROM
+
+typedef struct {
+	uint32_t time; // msec, from systick_now()
+	uint8_t code;
+	uint16_t arg;
+} event_t;
+
+// Exactly PARKED_RECORD_SIZE bytes, with the type in byte 1
+typedef struct {
+	uint8_t check;
+	uint8_t type; // PARKED_TYPE_EVENTS
+	event_t events[EVENT_KEEP]; // Oldest first
+} event_record_t;
+
+static event_t events[EVENT_LOG];
+static uint16_t event_count; // Entries ever logged, the next one goes to event_count % EVENT_LOG
+static uint8_t last_cc;
+
+static uint16_t dump_next; // Entry count of the next entry to report
+static uint8_t dump_left;
+
+#define DUMP_ROOM 24 // Free output buffer needed for one entry
+
+static uint8_t event_check(event_record_t *rec)
+{
+	uint8_t *p = (uint8_t *)rec;
+	uint8_t sum = 0x5A;
+	uint8_t i;
+
+	for (i = 1; i < sizeof(*rec); i++)
+		sum += p[i];
+
+	return sum;
+}
+
+void event_init(void)
+{
+	event_record_t *rec = (event_record_t *)config_parked_record(PARKED_TYPE_EVENTS);
+	uint8_t rst = RST_SR;
+	uint8_t i;
+
+	RST_SR = rst; // The flags clear by writing them back
+
+	if (rec && rec->check == event_check(rec)) {
+		for (i = 0; i < EVENT_KEEP; i++) {
+			if (rec->events[i].code == 0)
+				continue;
+			events[event_count & (EVENT_LOG-1)] = rec->events[i];
+			events[event_count & (EVENT_LOG-1)].code |= EVENT_SAVED;
+			event_count++;
+		}
+	}
+
+	last_cc = state.constant_current;
+	event_log(EVENT_BOOT, rst);
+}
+
+void event_log(uint8_t code, uint16_t arg)
+{
+	event_t *ev = &events[(event_count - 1) & (EVENT_LOG-1)];
+
+	if (code < EVENT_UART_OVERRUN || event_count == 0 || ev->code != code) {
+		ev = &events[event_count & (EVENT_LOG-1)];
+		event_count++;
+	}
+
+	ev->time = systick_now();
+	ev->code = code;
+	ev->arg = arg;
+}
+
+void event_save(void)
+{
+	event_record_t rec;
+	uint8_t i;
+
+	for (i = 0; i < EVENT_KEEP; i++) {
+		if (event_count >= EVENT_KEEP - i)
+			rec.events[i] = events[(event_count - EVENT_KEEP + i) & (EVENT_LOG-1)];
+		else
+			rec.events[i].code = 0;
+		rec.events[i].code &= ~EVENT_SAVED;
+	}
+	rec.type = PARKED_TYPE_EVENTS;
+	rec.check = event_check(&rec);
+
+	config_park_record((uint8_t*)&rec);
+}
+
+// CV/CC changes are flipped by the port B interrupt, log them from here
+void event_update(void)
+{
+	uint8_t cc = state.constant_current;
+
+	if (cc != last_cc) {
+		last_cc = cc;
+		if (cc)
+			event_log(EVENT_CC, state.cout);
+		else
+			event_log(EVENT_CV, state.vout);
+	}
+}
+
+/* Starts "<now>,<entries>", the entries follow oldest first from
+ * event_drive() as the output buffer drains, "<time>,<code>,<arg>" per line.
+ */
+void event_report(void)
+{
+	dump_left = event_count < EVENT_LOG ? event_count : EVENT_LOG;
+	dump_next = event_count - dump_left;
+
+	uart_write_int32(systick_now());
+	uart_write_ch(',');
+	uart_write_int(dump_left);
+}
+
+void event_drive(void)
+{
+	event_t *ev;
+
+	if (!dump_left || uart_write_room() < DUMP_ROOM)
+		return;
+
+	// Entries overwritten since the dump started are skipped
+	if ((uint16_t)(event_count - dump_next) > EVENT_LOG)
+		dump_next = event_count - EVENT_LOG;
+
+	ev = &events[dump_next & (EVENT_LOG-1)];
+	uart_write_str("\r\n");
+	uart_write_int32(ev->time);
+	uart_write_ch(',');
+	uart_write_int(ev->code);
+	uart_write_ch(',');
+	uart_write_int(ev->arg);
+
+	dump_next++;
+	dump_left--;
+}
@@ -0,0 +1,51 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+#define EVENT_BOOT 1 // arg: RST_SR, 0 after power on or the reset pin
+#define EVENT_CC 2 // arg: Iout in mA
+#define EVENT_CV 3 // arg: Vout in mV
+#define EVENT_OCP 4 // arg: Iout in mA
+#define EVENT_POWERFAIL 5 // arg: Vin in mV
+// Repeats of these update the newest entry instead of taking a new one
+#define EVENT_UART_OVERRUN 6 // arg: overruns since boot
+#define EVENT_EEPROM 7 // arg: failed writes since boot
+
+#define EVENT_SAVED 0x80 // Flag on entries restored from EEPROM at boot
+
+#if FEATURE_EVENTS
+void event_init(void);
+void event_log(uint8_t code, uint16_t arg);
+void event_save(void);
+void event_update(void);
+void event_report(void);
+void event_drive(void);
+#else
+// Built without the event log, see FEATURES in the Makefile
+#define event_init()
+#define event_log(code, arg)
+#define event_save()
+#define event_update()
+#define event_drive()
+#endif
+
+#endif
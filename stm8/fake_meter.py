@@ -0,0 +1,49 @@
+#!/usr/bin/python
+
+# Stands in for "sigrok-cli -O analog --continuous" so that calibrate.py can be
+# run without a multimeter. The argument is a b3603-sim -p trace file, which is
+# followed like tail -f and the latest Vout reported, or "-" for a fixed 5V.
+
+import sys
+import time
+import random
+
+RATE = 10 # Readings per second
+NOISE = 0.002 # Volts
+
+def main():
+    if len(sys.argv) != 2:
+        print 'usage: %s <b3603-sim trace file>|-' % sys.argv[0]
+        return 1
+
+    trace = None
+    if sys.argv[1] != '-':
+        trace = open(sys.argv[1])
+    vout = 5.0
+    partial = ''
+
+    while True:
+        if trace:
+            while True:
+                line = trace.readline()
+                if line == '':
+                    break
+                partial += line
+                if not partial.endswith('\n'):
+                    break
+                # msec,vin,vout,iout,...
+                try:
+                    vout = float(partial.split(',')[2])
+                except (IndexError, ValueError):
+                    pass
+                partial = ''
+
+        print 'P1: %.4f V DC' % (vout + random.gauss(0, NOISE))
+        sys.stdout.flush()
+        time.sleep(1.0 / RATE)
+
+if __name__ == '__main__':
+    try:
+        sys.exit(main())
+    except (KeyboardInterrupt, IOError):
+        pass
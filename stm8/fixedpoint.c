@@ -33,3 +33,51 @@ uint32_t fixed_round(uint32_t x)
 
 	return x+round;
 }
+
+/* The calibration products are x * a with a 16 bit x and a 16.16 a, split
+ * into two 16x16 multiplies so that no intermediate can overflow whatever the
+ * calibration. The integer part of the product is at most 0xFFFE0001 + 0xFFFF
+ * and the fraction is kept apart, the results are rounded to nearest (half
+ * up, like fixed_round()) and saturate at 0 and 0xFFFF.
+ */
+static uint32_t mul_int(uint16_t x, uint32_t a, uint16_t *frac)
+{
+	uint32_t lo = (uint32_t)x * (uint16_t)a;
+	uint32_t hi = (uint32_t)x * (uint16_t)(a >> 16);
+
+	*frac = (uint16_t)lo;
+	return hi + (lo >> 16);
+}
+
+static uint16_t saturate(uint32_t x)
+{
+	return (x > 0xFFFF) ? 0xFFFF : (uint16_t)x;
+}
+
+// round((x * a + b) / 2^16)
+uint16_t fixed_mul_add(uint16_t x, uint32_t a, uint32_t b)
+{
+	uint16_t frac;
+	uint32_t i = mul_int(x, a, &frac);
+	uint32_t f = (uint32_t)frac + (uint16_t)b + 0x8000;
+
+	if (i > 0xFFFF)
+		return 0xFFFF; // Adding b can only make it larger
+	return saturate(i + (b >> 16) + (f >> 16));
+}
+
+// round(max(x * a - b, 0) / 2^16)
+uint16_t fixed_mul_sub(uint16_t x, uint32_t a, uint32_t b)
+{
+	uint16_t frac;
+	uint32_t i = mul_int(x, a, &frac);
+	uint32_t bi = b >> 16;
+
+	if (frac < (uint16_t)b)
+		bi++; // Borrow from the integer part
+	frac -= (uint16_t)b;
+
+	if (i < bi || (i == bi && frac == 0))
+		return 0;
+	return saturate(i - bi + (frac >= 0x8000));
+}
@@ -37,4 +37,11 @@ typedef uint16_t fixed_t;
 #define FLOAT_TO_FIXED(f) (uint32_t)((FLOAT_TO_FIXED_BASE(f) >> 1) + FLOAT_TO_FIXED_ROUNDING(f))
 uint32_t fixed_round(uint32_t x);
 
+/* Multiply a 16 bit value by a 16.16 factor and add or subtract a 16.16
+ * offset, rounded to nearest and saturated to 0..0xFFFF. These never overflow
+ * whatever the calibration values are, see fixedpoint.c.
+ */
+uint16_t fixed_mul_add(uint16_t x, uint32_t a, uint32_t b);
+uint16_t fixed_mul_sub(uint16_t x, uint32_t a, uint32_t b);
+
 #endif
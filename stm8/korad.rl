@@ -5,12 +5,46 @@
 #include "config.h"
 #include "outputs.h"
 #include "parse.h"
+#include "cvcc.h"
+#include "energy.h"
+#include "charge.h"
+#include "regulate.h"
+#include "eeprom.h"
+#include "display.h"
+#include "sweep.h"
+#include "event.h"
+#include "stats.h"
+#include "capture.h"
+#include "systick.h"
 extern cfg_system_t cfg_system;
 extern cfg_output_t cfg_output;
 extern state_t state;
+void reboot(void);
+void commit_output(void);
 
 #define uws(x) uart_write_str(x)
 
+/* Commands have no terminator, so a trailing number is only complete once the
+ * next command starts or nothing more came for ARG_IDLE msec. Until then the
+ * command is held in pending and applied once by apply_arg(), not on every
+ * digit.
+ */
+#define ARG_IDLE 20 // msec
+
+#define ARG_DISP 1
+#define ARG_BRIGHTNESS 2
+#define ARG_BLANK 3
+#define ARG_PSET 4
+#define ARG_RSET 5
+#define ARG_CHGI 6
+#define ARG_CHGT 7
+#define ARG_STATW 8
+#define ARG_CAPT_EVERY 9
+#define ARG_SWEEP_SETTLE 10
+
+static uint8_t pending;
+static uint32_t last_input;
+
 %%{
 machine korad;
 
@@ -19,6 +53,7 @@ action print_idn {uws(MODEL);}
 action print_status {
        uint8_t xyzzy=0;
        xyzzy |= state.constant_current?0:1;
+       xyzzy |= cfg_output.cshutdown?32:0;
        xyzzy |= cfg_system.output?64:0;
        uart_write_ch(xyzzy);
        }
@@ -28,14 +63,81 @@ action print_vout1 {uart_write_millivolt(state.vout);}
 action print_iset1 {uart_write_millivolt(cfg_output.cset);}
 action print_iout1 {uart_write_millivolt(state.cout);}
 
-action outon {cfg_system.output = 1;commit_output();}
+action print_fault {uart_write_int(state.fault);}
+action print_cvcc {cvcc_report();}
+action print_energy {energy_report();}
+action print_charge {charge_report();}
+action print_mode {regulate_report();}
+action print_display {display_report();}
+action dispsel {pending = ARG_DISP;}
+action print_brightness {
+       uart_write_int(cfg_system.brightness);
+       uart_write_ch(',');
+       uart_write_int(cfg_system.blank_time);
+       uart_write_ch(',');
+       uart_write_int(display_is_dark());
+       }
+action brightness {pending = ARG_BRIGHTNESS;}
+action blanktime {pending = ARG_BLANK;}
+action syssave {config_save_system(&cfg_system);}
+action print_sweep {sweep_report();}
+action print_log {event_report();}
+action print_stats {stats_report();}
+action statswin {pending = ARG_STATW;}
+action print_capture {capture_report();}
+action boot {reboot();}
+action captarm {capture_arm();}
+action captstop {capture_stop();}
+action captchan {capture_param(CAPTURE_CHANNEL, ival); ival = 0;}
+action capttrig {capture_param(CAPTURE_TRIGGER, ival); ival = 0;}
+action captlevel {capture_param(CAPTURE_LEVEL, ival); ival = 0;}
+action captpre {capture_param(CAPTURE_PRE, ival); ival = 0;}
+action captevery {pending = ARG_CAPT_EVERY;}
+action sweepv {sweep_start(SWEEP_VOUT);}
+action sweepc {sweep_start(SWEEP_COUT);}
+action sweepoff {sweep_stop();}
+action swfirst {sweep_param(SWEEP_FIRST, ival); ival = 0;}
+action swlast {sweep_param(SWEEP_LAST, ival); ival = 0;}
+action swstep {sweep_param(SWEEP_STEP, ival); ival = 0;}
+action swsettle {pending = ARG_SWEEP_SETTLE;}
+action print_eeprom {
+       static const char * const names[] = { "IDLE", "BUSY", "DONE", "FAILED" };
+       uws(names[eeprom_status()]);
+       uart_write_ch(',');
+       uart_write_int(eeprom_failures());
+       }
+
+action outon {cfg_system.output = 1;state.fault = 0;commit_output();}
 action outoff {cfg_system.output = 0;commit_output();}
 
+action ocpon {cfg_output.cshutdown = 1;commit_output();}
+action ocpoff {cfg_output.cshutdown = 0;commit_output();}
+
+action erst {energy_reset();}
+action esav {energy_save();}
+action eperson {energy_persist(1);}
+action epersoff {energy_persist(0);}
+
+action chgon {charge_start();}
+action chgoff {charge_stop();}
+action chgi {pending = ARG_CHGI;}
+action chgt {pending = ARG_CHGT;}
+
+action pset {pending = ARG_PSET;}
+action rset {pending = ARG_RSET;}
+action modecvcc {regulate_mode(REGULATE_CVCC);}
+
+action sav {config_save_output(&cfg_output);}
+action rcl {config_load_output(&cfg_output);commit_output();}
+
 action vset {cfg_output.vset = val;commit_output();}
 action iset {cfg_output.cset = val;commit_output();}
 
-action millinum {val = parse_millinum(inbuf); inbufp=0;}
-action digcoll {inbuf[inbufp++]=fc;inbuf[inbufp]=0;}
+action millinum {val = parse_millinum((uint8_t *)inbuf); inbufp=0;}
+action bufstart {inbufp = 0;}
+action digcoll {if (inbufp < BUFSIZE-1) {inbuf[inbufp++]=fc;inbuf[inbufp]=0;}}
+action intstart {ival = 0;}
+action intdig {ival = ival < 6553 ? ival*10 + (fc-'0') : 0xFFFF;}
 
 
 idnq = '*IDN?' @ print_idn;
@@ -44,31 +146,82 @@ vsetq = 'VSET1?' @ print_vset1;
 voutq = 'VOUT1?' @ print_vout1;
 isetq = 'ISET1?' @ print_iset1;
 ioutq = 'IOUT1?'@ print_iout1;
+faultq = 'FAULT?' @ print_fault;
+cvccq = 'CVCC?' @ print_cvcc;
+energyq = 'ENERGY?' @ print_energy;
+erst = 'ERST' @ erst;
+esav = 'ESAV' @ esav;
+eperson = 'EPERS1' @ eperson;
+epersoff = 'EPERS0' @ epersoff;
+chargeq = 'CHG?' @ print_charge;
+chgon = 'CHG1' @ chgon;
+chgoff = 'CHG0' @ chgoff;
+modeq = 'MODE?' @ print_mode;
+eepromq = 'EEP?' @ print_eeprom;
+displayq = 'DISP?' @ print_display;
+brightnessq = 'BRT?' @ print_brightness;
+syssave = 'SYSSAV' @ syssave;
+sweepq = 'SWEEP?' @ print_sweep;
+logq = 'LOG?' @ print_log;
+statsq = 'STATS?' @ print_stats;
+captureq = 'CAPT?' @ print_capture;
+captarm = 'CAPT1' @ captarm;
+captstop = 'CAPT0' @ captstop;
+boot = 'BOOT' @ boot;
+sweepv = 'SWEEP1' @ sweepv;
+sweepc = 'SWEEP2' @ sweepc;
+sweepoff = 'SWEEP0' @ sweepoff;
+modecvcc = 'MODE0' @ modecvcc;
 outon = 'OUT1' @ outon;
 outoff = 'OUT0' @ outoff;
 ovpon = 'OVP1';
 ovpoff = 'OVP0';
-ocpon = 'OCP1';
-ocpoff = 'OCP0';
+ocpon = 'OCP1' @ ocpon;
+ocpoff = 'OCP0' @ ocpoff;
 track = 'TRACK0';
-rcl = 'RCL1';
-sav = 'SAV1';
+rcl = 'RCL1' @ rcl;
+sav = 'SAV1' @ sav;
 chomp = alnum;
 
 
 dig = digit @ digcoll;
 
 voltage =  dig+ ('.'@digcoll dig dig)? @ millinum;
-current =  dig+ ('.'@digcoll dig dig dig)? @ millinum;
+decimal = dig+ ('.' @digcoll dig+)?;
+integer = (digit @ intdig)+;
 
 vset = ('VSET1:' voltage) @ vset;
 cset = ('ISET1:' voltage) @ iset;
+chgi = ('CHGI:' @ bufstart decimal) @ chgi;
+chgt = ('CHGT:' @ intstart integer) @ chgt;
+pset = ('PSET1:' @ bufstart decimal) @ pset;
+rset = ('RSET1:' @ bufstart decimal) @ rset;
+dispsel = ('DISP:' @ intstart integer) @ dispsel;
+brightness = ('BRT:' @ intstart integer) @ brightness;
+blanktime = ('BLANK:' @ intstart integer) @ blanktime;
+statswin = ('STATW:' @ intstart integer) @ statswin;
+captcfg = ('CAPT:' @ intstart integer ',' @ captchan integer ',' @ capttrig integer ',' @ captlevel integer ',' @ captpre integer) @ captevery;
+sweepcfg = ('SWEEP:' @ intstart integer ',' @ swfirst integer ',' @ swlast integer ',' @ swstep integer) @ swsettle;
+eol = '\r' | '\n'; # Line ends from terminals, they only apply a trailing number
+
+core = idnq|statusq|vsetq|voutq|isetq|ioutq|faultq|cvccq|eepromq|displayq|dispsel|brightnessq|brightness|blanktime|syssave|boot|outon|outoff|ovpon|ocpon|ocpoff|track|rcl|sav|vset|eol;
+
+# Commands of the optional FEATURES, main is written to korad-main.rl by the
+# Makefile with the groups of those built in, see RL_* there. The actions of
+# the commands left out are never referenced, so ragel leaves them out too.
+energy = energyq|erst|esav|eperson|epersoff;
+charge = chargeq|chgon|chgoff|chgi|chgt;
+regulate = modeq|modecvcc|pset|rset;
+sweep = sweepq|sweepv|sweepc|sweepoff|sweepcfg;
+events = logq;
+stats = statsq|statswin;
+capture = captureq|captarm|captstop|captcfg;
 
-main := (idnq|statusq|vsetq|voutq|isetq|ioutq|outon|outoff|ovpon|ocpon|ocpoff|track|rcl|sav|vset)**;
+include "korad-main.rl";
 
 }%%
 
-%% write data;
+%% write data noerror nofinal noentry;
 
 #define BUFSIZE 30
 	
@@ -76,10 +229,78 @@ main := (idnq|statusq|vsetq|voutq|isetq|ioutq|outon|outoff|ovpon|ocpon|ocpoff|tr
      char *ts, *te;
      int stack[1], top;
      uint16_t val;
+     uint16_t ival;
 
      static char inbuf[BUFSIZE];
      int inbufp=0;     
 
+static void apply_arg(void)
+{
+	switch (pending) {
+		case ARG_DISP:
+			display_quantity(ival);
+			break;
+		case ARG_BRIGHTNESS:
+			if (ival >= 1 && ival <= 8) {
+				cfg_system.brightness = ival;
+				display_brightness(ival);
+			}
+			break;
+		case ARG_BLANK:
+			if (ival <= 255) {
+				cfg_system.blank_time = ival;
+				display_blank_time(ival);
+			}
+			break;
+#if FEATURE_REGULATE
+		case ARG_PSET:
+			val = parse_centinum((uint8_t *)inbuf);
+			if (val != 0xFFFF)
+				regulate_power(val);
+			break;
+		case ARG_RSET:
+			val = parse_millinum((uint8_t *)inbuf);
+			if (val != 0xFFFF)
+				regulate_resistance(val);
+			break;
+#endif
+#if FEATURE_CHARGE
+		case ARG_CHGI:
+			val = parse_millinum((uint8_t *)inbuf);
+			if (val != 0xFFFF)
+				cfg_output.iterm = val;
+			break;
+		case ARG_CHGT:
+			cfg_output.charge_timeout = ival;
+			break;
+#endif
+#if FEATURE_STATS
+		case ARG_STATW:
+			stats_window(ival);
+			break;
+#endif
+#if FEATURE_CAPTURE
+		case ARG_CAPT_EVERY:
+			capture_param(CAPTURE_EVERY, ival);
+			break;
+#endif
+#if FEATURE_SWEEP
+		case ARG_SWEEP_SETTLE:
+			sweep_param(SWEEP_SETTLE, ival);
+			break;
+#endif
+	}
+
+	pending = 0;
+}
+
+// Called from the main loop, applies a trailing number nothing followed
+void parseidle(void)
+{
+	if (pending && systick_now() - last_input >= ARG_IDLE)
+		apply_arg();
+}
+
 void initmachine () {
 
 	%% write init;
@@ -93,5 +314,9 @@ char *p = &cv;
 char *pe = p + 1;
 //uart_write_ch(c);
 
+	last_input = systick_now();
+	if (pending && c != '.' && (c < '0' || c > '9'))
+		apply_arg();
+
 	%% write exec;
 }
\ No newline at end of file
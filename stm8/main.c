@@ -31,9 +31,24 @@
 #include "config.h"
 #include "parse.h"
 #include "adc.h"
+#include "systick.h"
+#include "cvcc.h"
+#include "energy.h"
+#include "charge.h"
+#include "regulate.h"
+#include "powerfail.h"
+#include "ui.h"
+#include "sweep.h"
+#include "event.h"
+#include "stats.h"
+#include "capture.h"
 
 #include "capabilities.h"
 
+// The command parser, korad.rl
+void initmachine(void);
+void parseidle(void);
+
 cfg_system_t cfg_system;
 cfg_output_t cfg_output;
 state_t state;
@@ -49,9 +64,27 @@ inline void iwatchdog_tick(void)
 	IWDG_KR = 0xAA; // Reset the counter
 }
 
+#define SAVE_DELAY 1000 // msec without changes before the output config is saved
+
+static uint8_t output_dirty;
+static uint32_t output_changed;
+
 void commit_output()
 {
+	static uint8_t was_on;
+
+	if (!was_on && cfg_system.output)
+		capture_event(CAPTURE_ON_OUTPUT);
+
 	output_commit(&cfg_output, &cfg_system, state.constant_current);
+
+	// Setpoints may have changed, save them once things calm down
+	output_dirty = 1;
+	output_changed = systick_now();
+
+	if (was_on && !cfg_system.output)
+		energy_output_off();
+	was_on = cfg_system.output;
 }
 
 
@@ -103,11 +136,21 @@ void config_load(void)
 	config_load_system(&cfg_system);
 	config_load_output(&cfg_output);
 
+	display_brightness(cfg_system.brightness);
+	display_blank_time(cfg_system.blank_time);
+
 	if (cfg_system.default_on)
 		cfg_system.output = 1;
 	else
 		cfg_system.output = 0;
 
+	// Come back the way we were if the power failed under us, only once
+	if (config_output_flags() & OUTPUT_FLAG_RESTORE) {
+		cfg_system.output = 1;
+		config_set_output_flags(&cfg_output, 0);
+	}
+	energy_load();
+
 #if DEBUG
 	state.pc3 = 1;
 #endif
@@ -115,7 +158,10 @@ void config_load(void)
 
 void read_state(void)
 {
+#if DEBUG
 	uint8_t tmp;
+#endif
+	uint16_t tmp16;
 
 #if DEBUG 
 	tmp = (PC_IDR & (1<<3)) ? 1 : 0;
@@ -127,13 +173,20 @@ void read_state(void)
 	}
 #endif
 
-	tmp = (PB_IDR & (1<<5)) ? 1 : 0;
-	if (state.constant_current != tmp) {
-		state.constant_current = tmp;
-		output_check_state(&cfg_system, state.constant_current);
+	if (cfg_system.output && output_tripped()) {
+		// The break input already cut the current PWM, finish the job
+		cfg_system.output = 0;
+		state.fault |= FAULT_OCP;
+		commit_output();
+		event_log(EVENT_OCP, state.cout);
+		event_save();
 	}
 
-	if (adc_ready()) {
+	// CV/CC transitions are tracked by cvcc_isr()
+	event_update();
+
+	// A burst capture has the ADC to itself, the readings hold meanwhile
+	if (!capture_owns_adc() && adc_ready()) {
 		uint16_t val = adc_read();
 		uint8_t ch = adc_channel();
 
@@ -142,6 +195,9 @@ void read_state(void)
 				state.cout_raw = val;
 				// Calculation: val * cal_cout_a * 3.3 / 1024 - cal_cout_b
 				state.cout = adc_to_volt(val, &cfg_system.cout_adc);
+				energy_update(state.vout, state.cout, cfg_system.output);
+				charge_update(state.cout);
+				stats_update(STATS_COUT, state.cout);
 				ch = 3;
 								  
 				//display_show_uint16(state.cout);
@@ -151,68 +207,104 @@ void read_state(void)
 				state.vout_raw = val;
 				// Calculation: val * cal_vout_a * 3.3 / 1024 - cal_vout_b
 				state.vout = adc_to_volt(val, &cfg_system.vout_adc);
+				stats_update(STATS_VOUT, state.vout);
 				ch = 4;
-				  
-				display_show_uint16(0x3E<<1, state.vout);
-				
 				break;
 			case 4:
 				state.vin_raw = val;
 				// Calculation: val * cal_vin * 3.3 / 1024
 				state.vin = adc_to_volt(val, &cfg_system.vin_adc);
+				stats_update(STATS_VIN, state.vin);
 				ch = 2;
-								  
-				//display_show_uint16(state.vin);
 
+				// End of a round, all readings are fresh
+				sweep_sample(&state);
+				if (!ui_active())
+					display_measurement(&state);
 				break;
 		}
 
 		adc_start(ch);
 	}
+
+	if (adc_probe(&tmp16))
+		powerfail_update(adc_to_volt(tmp16, &cfg_system.vin_adc));
 }
 
-void ensure_afr0_set(void)
+#define OPT2_AFR (OPT2_AFR0 | OPT2_AFR4)
+
+void autosave(void)
 {
-	if ((OPT2 & 1) == 0) {
+	// Stays dirty while the EEPROM writer has no room, the next pass retries
+	if (output_dirty && systick_now() - output_changed >= SAVE_DELAY)
+		output_dirty = !config_save_output(&cfg_output);
+}
+
+void ensure_afr_set(void)
+{
+	if ((OPT2 & OPT2_AFR) != OPT2_AFR) {
 		uart_flush_writes();
-		if (eeprom_set_afr0()) {
-			uart_write_str("AFR0 set, reseting the unit\r\n");
+		if (eeprom_set_afr(OPT2_AFR)) {
+			uart_write_str("AFR set, reseting the unit\r\n");
 			uart_flush_writes();
 			iwatchdog_init();
 			while (1); // Force a reset in a few msec
 		}
 		else {
-			uart_write_str("AFR0 not set and programming failed!\r\n");
+			uart_write_str("AFR not set and programming failed!\r\n");
 		}
 	}
 }
 
-int main()
+// Hands over to the bootloader, which sees the reset and waits for an upload
+void reboot(void)
 {
-	unsigned long i = 0;
+	cfg_system.output = 0;
+	commit_output();
+	uart_flush_writes();
+	while (!(USART1_SR & USART_SR_TC)); // The last byte is still going out
+	// T6 clear resets at once, the loop is for the simulator which sees a write on the next access
+	while (1)
+		WWDG_CR = WWDG_CR_WDGA;
+}
 
+int main()
+{
 	pinout_init();
 	clk_init();
 	uart_init();
 	pwm_init();
 	adc_init();
+	systick_init();
 
 	config_load();
 	initmachine();
 	
 	uart_write_str("\r\n" MODEL " starting: Version " FW_VERSION "\r\n");
 
-	ensure_afr0_set();
+	ensure_afr_set();
 
 	iwatchdog_init();
+	cvcc_init();
+	event_init();
+	enable_interrupts();
 	adc_start(4);
 	commit_output();
 
 	do {
 		iwatchdog_tick();
 		read_state();
+		regulate_update();
+		sweep_update();
+		autosave();
+		ui_update();
 		display_refresh();
 		uart_drive();
+		parseidle();
+		cvcc_drive();
+		event_drive();
+		capture_drive();
+		eeprom_drive();
 
 	} while(1);
 }
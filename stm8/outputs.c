@@ -26,30 +26,40 @@
 #define PWM_HIGH (PWM_VAL >> 8)
 #define PWM_LOW (PWM_VAL & 0xFF)
 
+/* Both channels use preloaded compare and reload registers, a new compare
+ * value only takes effect at the next update event so a setpoint change can
+ * never produce a runt pulse. While the output is off the channels are forced
+ * to the active level, which with the active low polarity is the same as a
+ * zero compare but does not depend on the timer running.
+ */
+#define CCMR_PWM (TIM_CCMR_OCM_PWM2 | TIM_CCMR_OCPE)
+#define CCMR_OFF TIM_CCMR_OCM_FORCE_ACTIVE
+
 void pwm_init(void)
 {
 	/* Timer 1 Channel 1 for Iout control */
-	TIM1_CR1 = 0x10; // Down direction
+	TIM1_CR1 = TIM_CR1_APRE | TIM_CR1_DIR; // Preload reload value, down direction
 	TIM1_ARRH = PWM_HIGH; // Reload counter = 16384
 	TIM1_ARRL = PWM_LOW;
 	TIM1_PSCRH = 0; // Prescaler 0 means division by 1
 	TIM1_PSCRL = 0;
 	TIM1_RCR = 0; // Continuous
 
-	TIM1_CCMR1 = 0x70;    //  Set up to use PWM mode 2.
+	TIM1_CCMR1 = CCMR_OFF; //  PWM mode 2 is selected when the output is turned on
 	TIM1_CCER1 = 0x03;    //  Output is enabled for channel 1, active low
 	TIM1_CCR1H = 0x00;      //  Start with the PWM signal off
 	TIM1_CCR1L = 0x00;
 
-	TIM1_BKR = 0x80;       //  Enable the main output.
+	TIM1_OISR = 0x00;      //  Idle state of OC1 is low, the same as a zero compare
+	TIM1_BKR = TIM_BKR_MOE; //  Enable the main output, break is armed by output_commit()
 
 	/* Timer 2 Channel 1 for Vout control */
 	TIM2_ARRH = PWM_HIGH; // Reload counter = 16384
 	TIM2_ARRL = PWM_LOW;
 	TIM2_PSCR = 0; // Prescaler 0 means division by 1
-	TIM2_CR1 = 0x00;
+	TIM2_CR1 = TIM_CR1_APRE;
 
-	TIM2_CCMR1 = 0x70;    //  Set up to use PWM mode 2.
+	TIM2_CCMR1 = CCMR_OFF; //  PWM mode 2 is selected when the output is turned on
 	TIM2_CCER1 = 0x03;    //  Output is enabled for channel 1, active low
 	TIM2_CCR1H = 0x00;      //  Start with the PWM signal off
 	TIM2_CCR1L = 0x00;
@@ -76,49 +86,128 @@ inline void cvcc_led_off(void)
 
 uint16_t pwm_from_set(fixed_t set, calibrate_t *cal)
 {
-	uint32_t tmp;
-
-	// x*a
-	tmp = set * cal->a;
-
-	// x*a + b
-	tmp += cal->b;
-
 	// PWM is 0x8000 and as such amounts to a shift by 13 so to multiple by PWM
 	// we simply shift all calculations by 3 and this avoids overflows and loss
 	// of precision.
 
-	return fixed_round(tmp);
+	// x*a + b
+	return fixed_mul_add(set, cal->a, cal->b);
+}
+
+/* The compare value of each channel is cached together with the setpoint it
+ * was computed from. pwm_from_set() only runs again when the setpoint changes,
+ * the calibration is only loaded at boot, and the timer is only written when
+ * the compare value itself changes.
+ */
+typedef struct {
+	uint16_t set; // Setpoint the compare value was computed from
+	uint16_t ctr; // Compare value
+	uint8_t valid; // ctr belongs to set
+	uint8_t loaded; // ctr is in the preload register
+} pwm_cache_t;
+
+static pwm_cache_t vout_cache;
+static pwm_cache_t cout_cache;
+
+// Returns true if the compare value needs to be written to the timer
+static uint8_t pwm_cache_update(pwm_cache_t *cache, uint16_t set, calibrate_t *cal)
+{
+	uint16_t ctr;
+
+	if (cache->valid && cache->set == set)
+		return !cache->loaded;
+
+	ctr = pwm_from_set(set, cal);
+	if (ctr != cache->ctr)
+		cache->loaded = 0;
+	cache->ctr = ctr;
+	cache->set = set;
+	cache->valid = 1;
+
+	return !cache->loaded;
+}
+
+void output_voltage(cfg_system_t *sys, uint16_t vset)
+{
+	if (pwm_cache_update(&vout_cache, vset, &sys->vout_pwm)) {
+		// High byte first, the pair is transferred on the next update event
+		TIM2_CCR1H = vout_cache.ctr >> 8;
+		TIM2_CCR1L = vout_cache.ctr & 0xFF;
+		vout_cache.loaded = 1;
+	}
+}
+
+/* Writes a compare value directly, for the calibration sweep. The next commit
+ * puts the setpoint back.
+ */
+void output_raw(uint8_t channel, uint16_t ctr)
+{
+	if (channel == OUTPUT_VOUT) {
+		TIM2_CCR1H = ctr >> 8;
+		TIM2_CCR1L = ctr & 0xFF;
+		vout_cache.loaded = 0;
+	} else {
+		TIM1_CCR1H = ctr >> 8;
+		TIM1_CCR1L = ctr & 0xFF;
+		cout_cache.loaded = 0;
+	}
 }
 
 inline void control_voltage(cfg_output_t *cfg, cfg_system_t *sys)
 {
-	uint16_t ctr = pwm_from_set(cfg->vset, &sys->vout_pwm);
-	//	uart_write_str("PWM VOLTAGE ");
-	//uart_write_int(ctr);
-	//uart_write_str("\r\n");
-
-	TIM2_CCR1H = ctr >> 8;
-	TIM2_CCR1L = ctr & 0xFF;
-	TIM2_CR1 |= 0x01; // Enable timer
+	output_voltage(sys, cfg->vset);
+
+	if (!(TIM2_CR1 & TIM_CR1_CEN)) {
+		TIM2_CCMR1 = CCMR_PWM;
+		TIM2_EGR = TIM_EGR_UG; // Load the preload registers right away
+		TIM2_CR1 |= TIM_CR1_CEN; // Enable timer
+	}
 }
 
 inline void control_current(cfg_output_t *cfg, cfg_system_t *sys)
 {
-	uint16_t ctr = pwm_from_set(cfg->cset, &sys->cout_pwm);
-	//uart_write_str("PWM CURRENT ");
-	//uart_write_int(ctr);
-	//uart_write_str("\r\n");
-
-	TIM1_CCR1H = ctr >> 8;
-	TIM1_CCR1L = ctr & 0xFF;
-	TIM1_CR1 |= 0x01; // Enable timer
+	if (pwm_cache_update(&cout_cache, cfg->cset, &sys->cout_pwm)) {
+		TIM1_CCR1H = cout_cache.ctr >> 8;
+		TIM1_CCR1L = cout_cache.ctr & 0xFF;
+		cout_cache.loaded = 1;
+	}
+
+	if (!(TIM1_CR1 & TIM_CR1_CEN)) {
+		TIM1_CCMR1 = CCMR_PWM;
+		TIM1_EGR = TIM_EGR_UG;
+		TIM1_CR1 |= TIM_CR1_CEN;
+	}
+}
+
+/* With over current protection the CV/CC sense line on PB5 doubles as the TIM1
+ * break input. Entering CC then clears MOE in hardware and forces the Iout
+ * PWM to its idle (off) level without waiting for the main loop, the rest of
+ * the shutdown is done by output_commit() once output_tripped() reports it.
+ */
+inline void control_break(cfg_output_t *cfg)
+{
+	TIM1_SR1 = (uint8_t)~TIM_SR1_BIF; // Forget about a previous trip
+
+	if (cfg->cshutdown)
+		TIM1_BKR = TIM_BKR_MOE | TIM_BKR_BKE | TIM_BKR_BKP | TIM_BKR_OSSI;
+	else
+		TIM1_BKR = TIM_BKR_MOE;
+}
+
+uint8_t output_tripped(void)
+{
+	if (TIM1_SR1 & TIM_SR1_BIF) {
+		TIM1_SR1 = (uint8_t)~TIM_SR1_BIF;
+		return 1;
+	}
+	return 0;
 }
 
 void output_commit(cfg_output_t *cfg, cfg_system_t *sys, uint8_t state_constant_current)
 {
 	// Startup and shutdown orders need to be in reverse order
 	if (sys->output) {
+		control_break(cfg);
 		control_voltage(cfg, sys);
 		control_current(cfg, sys);
 
@@ -130,14 +219,15 @@ void output_commit(cfg_output_t *cfg, cfg_system_t *sys, uint8_t state_constant_
 		PB_ODR |= (1<<4);
 
 		// Turn off PWM for Iout
-		TIM1_CCR1H = 0;
-		TIM1_CCR1L = 0;
-		TIM1_CR1 &= 0xFE; // Disable timer
+		TIM1_CCMR1 = CCMR_OFF;
+		TIM1_CR1 &= ~TIM_CR1_CEN; // Disable timer
+		TIM1_BKR = TIM_BKR_MOE; // Disarm the break input
+		cout_cache.loaded = 0;
 
 		// Turn off PWM for Vout
-		TIM2_CCR1H = 0;
-		TIM2_CCR1L = 0;
-		TIM2_CR1 &= 0xFE; // Disable timer
+		TIM2_CCMR1 = CCMR_OFF;
+		TIM2_CR1 &= ~TIM_CR1_CEN; // Disable timer
+		vout_cache.loaded = 0;
 
 		// Turn off CV/CC led
 		cvcc_led_off();
@@ -23,8 +23,15 @@
 
 #include "config.h"
 
+#define OUTPUT_VOUT 1 // TIM2 channel 1
+#define OUTPUT_COUT 2 // TIM1 channel 1
+
 void pwm_init(void);
+uint16_t pwm_from_set(fixed_t set, calibrate_t *cal);
 void output_commit(cfg_output_t *cfg, cfg_system_t *sys, uint8_t state_constant_current);
 void output_check_state(cfg_system_t *sys, uint8_t state_constant_current);
+uint8_t output_tripped(void);
+void output_voltage(cfg_system_t *sys, uint16_t vset);
+void output_raw(uint8_t channel, uint16_t ctr);
 
 #endif
@@ -37,19 +37,24 @@ uint16_t parse_num(uint8_t *s, uint8_t **stop, uint8_t *digits_seen)
 	return num;
 }
 
-uint16_t parse_millinum(uint8_t *s)
+/* Parses "<whole>[.<fraction>]" into units of 10^-decimals, at most
+ * max_whole_digits before the dot and decimals after it.
+ */
+static uint16_t parse_decimal(uint8_t *s, uint16_t max_whole, uint8_t max_whole_digits, uint8_t decimals)
 {
 	uint8_t *t = s;
 	uint8_t *stop;
-	uint32_t fraction_digits = 0;
+	uint16_t fraction_digits = 0;
 	uint16_t whole_digits = 0;
 	uint8_t digits_seen;
+	uint8_t i;
 
 	whole_digits = parse_num(s, &stop, &digits_seen);
-	if (whole_digits > 62 || digits_seen > 2)
+	if (whole_digits > max_whole || digits_seen > max_whole_digits)
 		goto invalid_number;
 
-	whole_digits *= 1000;
+	for (i = 0; i < decimals; i++)
+		whole_digits *= 10;
 
 	if (*stop == '\0')
 		return whole_digits;
@@ -58,20 +63,30 @@ uint16_t parse_millinum(uint8_t *s)
 		goto invalid_number;
 
 	fraction_digits = parse_num(stop+1, &stop, &digits_seen);
-	if (fraction_digits > 999 || digits_seen > 3)
+	if (digits_seen > decimals || *stop != '\0')
 		goto invalid_number;
 
-	if (digits_seen == 1)
-		fraction_digits *= 100;
-	else if (digits_seen == 2)
+	for (; digits_seen < decimals; digits_seen++)
 		fraction_digits *= 10;
 
 	return whole_digits + fraction_digits;
 
 invalid_number:
 	uart_write_str("INVALID NUMBER '");
-	uart_write_str(t);
+	uart_write_str((char *)t);
 	uart_write_ch('\'');
 	uart_write_str("\r\n");
 	return 0xFFFF;
 }
+
+// Volts or amps to milli units, up to 62.999
+uint16_t parse_millinum(uint8_t *s)
+{
+	return parse_decimal(s, 62, 2, 3);
+}
+
+// Watts to centi units, up to 654.99
+uint16_t parse_centinum(uint8_t *s)
+{
+	return parse_decimal(s, 654, 3, 2);
+}
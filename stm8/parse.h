@@ -22,5 +22,6 @@
 #include <stdint.h>
 
 uint16_t parse_millinum(uint8_t *s);
+uint16_t parse_centinum(uint8_t *s);
 
 #endif
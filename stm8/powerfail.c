@@ -0,0 +1,120 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "powerfail.h"
+#include "config.h"
+#include "outputs.h"
+#include "energy.h"
+#include "eeprom.h"
+#include "event.h"
+
+extern cfg_system_t cfg_system;
+extern cfg_output_t cfg_output;
+extern state_t state;
+
+void commit_output(void);
+
+/* Vin is probed with single conversions every few hundred usec, see
+ * adc_probe(), and compared against a running average over the last ~16
+ * probes. Falling more than 1/8 and at least PF_MARGIN below the average, so
+ * faster than the average can follow, for PF_CONFIRM probes in a row, or any
+ * reading under PF_FLOOR, means the input is going away. A load step only
+ * pulls the supply down by a fraction of that or for a shorter time. The
+ * output is turned off to stop draining the input capacitors and the energy
+ * snapshot plus the output config with the restore flag (8 word writes at
+ * most) are written while they still hold the MCU up.
+ */
+#define PF_AVG_SHIFT 4
+#define PF_CONFIRM 3 // Probes below the threshold before we trip
+#define PF_MARGIN 1500 // mV, the least drop below the average that counts
+#define PF_FLOOR 6000 // mV, the MCU regulator is not far below
+#define PF_RECOVER 64 // Probes back near the average before we rearm
+
+#define PF_IDLE 0 // Vin never got comfortably above PF_FLOOR
+#define PF_ARMED 1
+#define PF_TRIPPED 2
+
+static uint8_t pf_state;
+static uint8_t pf_count;
+static uint32_t avg_acc; // Average times 2^PF_AVG_SHIFT
+
+static void powerfail_trip(void)
+{
+	uint8_t output = cfg_system.output;
+
+	pf_state = PF_TRIPPED;
+	pf_count = 0;
+
+	cfg_system.output = 0;
+	state.fault |= FAULT_POWERFAIL;
+	commit_output();
+
+	energy_snapshot();
+	config_set_output_flags(&cfg_output, output ? OUTPUT_FLAG_RESTORE : 0);
+	eeprom_flush();
+
+	// Only if the MCU is still up by then, it is not part of the budget above
+	event_log(EVENT_POWERFAIL, state.vin);
+	event_save();
+}
+
+// Called for every Vin probe
+void powerfail_update(uint16_t vin)
+{
+	uint16_t avg;
+	uint16_t drop;
+
+	if (avg_acc == 0) {
+		// First reading
+		avg_acc = (uint32_t)vin << PF_AVG_SHIFT;
+		return;
+	}
+
+	avg = avg_acc >> PF_AVG_SHIFT;
+	drop = avg >> 3;
+	if (drop < PF_MARGIN)
+		drop = PF_MARGIN;
+
+	if (pf_state == PF_TRIPPED) {
+		// A dip we survived, the snapshot must not outlive it
+		if (vin >= avg - (avg >> 4)) {
+			if (++pf_count >= PF_RECOVER) {
+				pf_state = PF_ARMED;
+				pf_count = 0;
+				energy_save();
+				config_set_output_flags(&cfg_output, 0);
+			}
+		} else {
+			pf_count = 0;
+		}
+		return;
+	}
+
+	if (pf_state == PF_IDLE) {
+		if (avg >= PF_FLOOR + (PF_FLOOR >> 3))
+			pf_state = PF_ARMED;
+	} else if (vin < avg - drop || vin < PF_FLOOR) {
+		// The average is left alone, it is the reference we fell from
+		if (++pf_count >= PF_CONFIRM)
+			powerfail_trip();
+		return;
+	}
+
+	pf_count = 0;
+	avg_acc = avg_acc - avg + vin;
+}
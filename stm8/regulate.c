@@ -0,0 +1,127 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "regulate.h"
+#include "config.h"
+#include "outputs.h"
+#include "systick.h"
+#include "uart.h"
+#include "capabilities.h"
+
+extern cfg_system_t cfg_system;
+extern cfg_output_t cfg_output;
+extern state_t state;
+
+void commit_output(void);
+
+#define REGULATE_PERIOD 10 // msec, 100 updates per second
+#define CP_MIN_CURRENT 5 // mA, below this the load is considered open
+
+static uint8_t mode;
+static uint16_t power; // 10 mW, PSET1 goes beyond 65.535 W
+static uint16_t resistance; // mOhm
+static uint16_t vtarget; // mV, currently commanded voltage
+static uint32_t last_update;
+static uint32_t rate_start;
+static uint16_t rate_count;
+static uint16_t rate; // Updates in the last full second
+
+void regulate_mode(uint8_t m)
+{
+	mode = m;
+	vtarget = cfg_output.vset;
+	rate_count = 0;
+	rate = 0;
+	rate_start = systick_now();
+
+	// Back to the plain setpoint, the loop takes over from there
+	commit_output();
+}
+
+void regulate_power(uint16_t cw)
+{
+	power = cw;
+	regulate_mode(REGULATE_CP);
+}
+
+void regulate_resistance(uint16_t mohm)
+{
+	resistance = mohm;
+	regulate_mode(REGULATE_CR);
+}
+
+/* Both modes compute a new voltage from the measured current and move half way
+ * towards it. For constant power into a resistive load this is a Newton
+ * iteration for sqrt(P*R) and converges in a handful of steps, applying P/I
+ * directly would just bounce between two voltages.
+ */
+void regulate_update(void)
+{
+	uint32_t now;
+	uint32_t v;
+	uint16_t vmax;
+
+	if (mode == REGULATE_CVCC || !cfg_system.output)
+		return;
+
+	now = systick_now();
+	if (now - last_update < REGULATE_PERIOD)
+		return;
+	last_update = now;
+
+	vmax = cfg_output.vset < CAP_VMAX ? cfg_output.vset : CAP_VMAX;
+
+	if (mode == REGULATE_CP) {
+		if (state.cout < CP_MIN_CURRENT)
+			v = vmax;
+		else
+			v = ((uint32_t)power * 10000) / state.cout;
+	} else {
+		v = ((uint32_t)state.cout * resistance) / 1000;
+		v = (v < cfg_output.vset) ? cfg_output.vset - v : 0;
+	}
+
+	v = (v + vtarget) >> 1;
+	if (v > vmax)
+		v = vmax;
+	if (v < CAP_VMIN)
+		v = CAP_VMIN;
+
+	// Written every time, a commit in between may have put vset back
+	vtarget = v;
+	output_voltage(&cfg_system, vtarget);
+
+	rate_count++;
+	if (now - rate_start >= 1000) {
+		rate = rate_count;
+		rate_count = 0;
+		rate_start = now;
+	}
+}
+
+static const char * const mode_names[] = { "CVCC", "CP", "CR" };
+
+// "<mode>,<updates per second>,<commanded mV>"
+void regulate_report(void)
+{
+	uart_write_str(mode_names[mode]);
+	uart_write_ch(',');
+	uart_write_int(rate);
+	uart_write_ch(',');
+	uart_write_int(mode == REGULATE_CVCC ? cfg_output.vset : vtarget);
+}
@@ -0,0 +1,39 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGULATE_H
+#define REGULATE_H
+
+#include <stdint.h>
+
+#define REGULATE_CVCC 0 // Plain CV/CC, whichever of vset and cset limits first
+#define REGULATE_CP 1 // Constant power
+#define REGULATE_CR 2 // Constant voltage behind a series resistance
+
+#if FEATURE_REGULATE
+void regulate_mode(uint8_t mode);
+void regulate_power(uint16_t cw);
+void regulate_resistance(uint16_t mohm);
+void regulate_update(void);
+void regulate_report(void);
+#else
+// Built without the CP and CR modes, see FEATURES in the Makefile
+#define regulate_update()
+#endif
+
+#endif
@@ -51,7 +51,7 @@ void set_name(uint8_t *name)
 	cfg_system.name[sizeof(cfg_system.name)-1] = 0;
 
 	uart_write_str("SNAME: ");
-	uart_write_str(cfg_system.name);
+	uart_write_str((char *)cfg_system.name);
 	uart_write_str("\r\n");
 }
 
@@ -77,7 +77,7 @@ void parse_uint(const char *name, uint32_t *pval, uint8_t *s)
 	uint32_t val = _parse_uint(s);
 	if (val == 0xFFFFFFFF) {
 		uart_write_str("FAILED TO PARSE ");
-		uart_write_str(s);
+		uart_write_str((char *)s);
 		uart_write_str(" FOR ");
 		uart_write_str(name);
 	} else {
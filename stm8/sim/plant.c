@@ -0,0 +1,103 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plant.h"
+
+#define VDD 3.3 // PWM high level and ADC reference, V
+
+#define PWM_TAU 0.0047 // Control RC filters, sec
+#define OUT_TAU 0.0005 // Regulator response, sec
+#define COUT 470e-6 // Output capacitor, F
+#define DROPOUT 1.0 // Minimum Vin - Vout, V
+
+/* Control and sense gains matching the default calibration in config.c */
+#define VCTRL_GAIN 0.0713 // V at the control pin per V out
+#define VCTRL_OFFSET 0.013
+#define CCTRL_GAIN 0.781 // V at the control pin per A out
+#define CCTRL_OFFSET 0.0645
+#define VSENSE_GAIN 0.0714
+#define VSENSE_OFFSET 0.033
+#define CSENSE_GAIN 0.781
+#define CSENSE_OFFSET 0.156
+#define VIN_DIVIDER 16.0
+
+void plant_init(plant_t *p)
+{
+	p->vin = 12.0;
+	p->load = 100.0;
+	p->vduty = 0;
+	p->cduty = 0;
+	p->enable = 0;
+
+	p->vpin = 0;
+	p->cpin = 0;
+	p->vout = 0;
+	p->iout = 0;
+	p->cc = 0;
+}
+
+static double clamp(double x, double lo, double hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+void plant_step(plant_t *p, double dt)
+{
+	double vset, cset, target, vmax;
+
+	p->vpin += (p->vduty * VDD - p->vpin) * dt / PWM_TAU;
+	p->cpin += (p->cduty * VDD - p->cpin) * dt / PWM_TAU;
+
+	vset = clamp((p->vpin - VCTRL_OFFSET) / VCTRL_GAIN, 0, 50);
+	cset = clamp((p->cpin - CCTRL_OFFSET) / CCTRL_GAIN, 0, 10);
+	vmax = clamp(p->vin - DROPOUT, 0, 50);
+
+	if (!p->enable) {
+		// Only the load discharges the output capacitor
+		if (p->load > 0)
+			p->vout -= p->vout / (p->load * COUT) * dt;
+		p->iout = 0;
+		p->cc = 0;
+		return;
+	}
+
+	target = vset < vmax ? vset : vmax;
+	p->cc = 0;
+	if (p->load > 0 && target / p->load > cset) {
+		target = cset * p->load;
+		p->cc = 1;
+	}
+
+	p->vout += (target - p->vout) * (dt < OUT_TAU ? dt / OUT_TAU : 1);
+	p->iout = p->load > 0 ? p->vout / p->load : 0;
+}
+
+double plant_vout_sense(plant_t *p)
+{
+	return clamp(p->vout * VSENSE_GAIN + VSENSE_OFFSET, 0, VDD);
+}
+
+double plant_cout_sense(plant_t *p)
+{
+	return clamp(p->iout * CSENSE_GAIN + CSENSE_OFFSET, 0, VDD);
+}
+
+double plant_vin_sense(plant_t *p)
+{
+	return clamp(p->vin / VIN_DIVIDER, 0, VDD);
+}
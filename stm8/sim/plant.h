@@ -0,0 +1,52 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANT_H
+#define PLANT_H
+
+/* Buck converter model. The Vout and Iout control PWMs go through an RC filter
+ * into the regulator, which drives the output capacitor into a resistive load
+ * limited by the current setting, Vin and the converter slew. The sense lines
+ * follow the B3603 analog front end closely enough for the default
+ * calibration to read within a few percent.
+ */
+typedef struct {
+	/* Inputs, set by the simulator */
+	double vin; // V
+	double load; // Ohm, 0 for open circuit
+	double vduty; // Vout control PWM duty, 0-1
+	double cduty; // Iout control PWM duty, 0-1
+	int enable; // Output enable
+
+	/* State */
+	double vpin; // Filtered Vout control, V
+	double cpin; // Filtered Iout control, V
+	double vout; // V
+	double iout; // A
+	int cc; // In constant current
+} plant_t;
+
+void plant_init(plant_t *p);
+void plant_step(plant_t *p, double dt);
+
+/* ADC pin voltages */
+double plant_vout_sense(plant_t *p);
+double plant_cout_sense(plant_t *p);
+double plant_vin_sense(plant_t *p);
+
+#endif
@@ -0,0 +1,992 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host simulation of the B3603, see sim.h. Build with "make sim".
+ *
+ * Simulated time advances by ACCESS_PS on every register access, this is where
+ * the peripherals and the plant are updated and interrupts are taken. A write
+ * is only acted upon at the access that follows it, which is soon enough for
+ * everything the firmware does. Write only registers such as IWDG_KR count
+ * every access as a write, USART1_DR counts as a read while RXNE is set and as
+ * a write otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+
+#include "sim.h"
+#include "plant.h"
+#include "stm8s.h"
+
+#undef main
+#undef REG
+#define REG(addr) sim_mem[addr] // Plain access for the simulator itself
+
+// Weak so that the bootloader, which takes no interrupts, runs here as well
+void systick_isr(void) __attribute__((weak));
+void cvcc_isr(void) __attribute__((weak));
+void capture_isr(void) __attribute__((weak));
+int firmware_main(void);
+
+#define PS_PER_MS 1000000000ULL
+#define CPU_PS 62500ULL // 16 MHz
+#define ACCESS_PS (8 * CPU_PS) // Time between register accesses
+#define PLANT_PS 10000000ULL // 10 usec plant steps
+#define ADC_PS (14 * 18 * CPU_PS) // 14 ADC clocks at fMASTER/18
+#define EEPROM_PS (6 * PS_PER_MS) // Byte or word programming time
+
+#define EEPROM_START 0x4000
+#define EEPROM_SIZE 128
+#define OPT_START 0x4800
+#define OPT_SIZE 11
+#define FLASH_START 0x8000
+#define FLASH_SIZE 0x2000
+
+unsigned char sim_mem[0x10000] __attribute__((aligned(4)));
+static unsigned char shadow[0x10000]; // Register values as last set or seen by the simulator
+
+// Sets a register without it being taken for a firmware write
+#define SET(reg, val) set_reg(&(reg) - sim_mem, (val))
+
+static void set_reg(unsigned int addr, unsigned char val)
+{
+	sim_mem[addr] = val;
+	shadow[addr] = val;
+}
+
+static uint64_t now; // ps
+static uint64_t accesses;
+static int pending = -1; // Register accessed last, written values are handled on the next access
+static int irq_enabled;
+static int in_isr;
+static int exti_pending;
+static uint64_t systick_count, cvcc_count, adc_count;
+
+static plant_t plant;
+static uint64_t next_plant;
+static uint32_t noise_seed = 1; // 0 turns the ADC noise off
+
+/* Options */
+static uint64_t stop_at; // 0 to run forever
+static const char *eeprom_file;
+static const char *flash_file;
+static uint64_t trace_every; // 0 for no trace
+static uint64_t next_trace;
+static int realtime;
+static int pty_fd = -1; // The UART on a pty, the client may not have read the last bytes yet
+static const char *pty_link; // Symlink to the pty slave, removed again at exit
+static volatile sig_atomic_t interrupted;
+static uint64_t next_pace;
+
+static void stats_print(void);
+
+/* ------------------- Exit ------------------- */
+
+static struct timespec wall_start;
+
+static double wall_elapsed(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - wall_start.tv_sec) + (ts.tv_nsec - wall_start.tv_nsec) / 1e9;
+}
+
+static void image_load_file(const char *file, unsigned int start, unsigned int size)
+{
+	FILE *f;
+
+	if (!file)
+		return;
+
+	f = fopen(file, "rb");
+	if (!f)
+		return; // Starts out erased and is created on exit
+
+	if (fread(&sim_mem[start], 1, size, f) != size)
+		fprintf(stderr, "sim: short image %s\n", file);
+	fclose(f);
+}
+
+static void image_save_file(const char *file, unsigned int start, unsigned int size)
+{
+	FILE *f;
+
+	if (!file)
+		return;
+
+	f = fopen(file, "wb");
+	if (!f || fwrite(&sim_mem[start], 1, size, f) != size)
+		perror(file);
+	if (f)
+		fclose(f);
+}
+
+static void sim_exit(int code, const char *why)
+{
+	double wall = wall_elapsed();
+	double sim = now / 1e12;
+
+	fflush(stdout);
+	// Closing the master throws away what the client has not read, e.g. the ACK before a jump
+	if (pty_fd >= 0)
+		usleep(200000);
+	if (pty_link)
+		unlink(pty_link);
+	image_save_file(eeprom_file, EEPROM_START, EEPROM_SIZE);
+	image_save_file(flash_file, FLASH_START, FLASH_SIZE);
+	stats_print();
+	fprintf(stderr, "sim: %s at %.3f sec, %.3f sec wall (%.1fx), %llu accesses, %llu systick, %llu cvcc and %llu ADC interrupts\n",
+			why, sim, wall, wall > 0 ? sim / wall : 0.0, (unsigned long long)accesses,
+			(unsigned long long)systick_count, (unsigned long long)cvcc_count, (unsigned long long)adc_count);
+	exit(code);
+}
+
+/* ------------------- Display ------------------- */
+
+static uint16_t hc595_shift;
+static uint8_t display_seg[4]; // Segments last latched for each digit, rightmost first
+
+static void display_pins(unsigned char old, unsigned char val)
+{
+	uint8_t i;
+
+	// PA1 rising shifts in PD4, the first bit sent ends up at the far end
+	if (!(old & (1<<1)) && (val & (1<<1)))
+		hc595_shift = (hc595_shift >> 1) | ((PD_ODR & (1<<4)) ? 0x8000 : 0);
+
+	// PA2 rising latches, the blank frame selects all digits and is skipped
+	if (!(old & (1<<2)) && (val & (1<<2))) {
+		for (i = 0; i < 4; i++) {
+			if ((hc595_shift | 0xFF) == (0xFFFF ^ (3 << (8+i*2))))
+				display_seg[i] = hc595_shift & 0xFF;
+		}
+	}
+}
+
+static char segments_char(uint8_t seg)
+{
+	static const uint8_t digits[10] = { 0xFC, 0x60, 0xDA, 0xF2, 0x66, 0xB6, 0xBE, 0xE0, 0xFE, 0xF6 };
+	static const struct { uint8_t seg; char ch; } letters[] = {
+		{ 0x00, ' ' }, { 0x7C, 'U' }, { 0xEE, 'A' }, { 0xCE, 'P' }, { 0x38, 'u' }, { 0x1C, 'L' },
+		{ 0x3A, 'o' }, { 0x1A, 'c' }, { 0x8E, 'F' }, { 0x0A, 'r' }, { 0x9E, 'E' }, { 0x02, '-' },
+	};
+	uint8_t i;
+
+	seg &= 0xFE;
+	for (i = 0; i < 10; i++)
+		if (digits[i] == seg)
+			return '0' + i;
+	for (i = 0; i < sizeof(letters)/sizeof(letters[0]); i++)
+		if (letters[i].seg == seg)
+			return letters[i].ch;
+	return '?';
+}
+
+static void display_text(char *buf)
+{
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		*buf++ = segments_char(display_seg[i]);
+		if (display_seg[i] & 1)
+			*buf++ = '.';
+	}
+	*buf = 0;
+}
+
+/* ------------------- UART ------------------- */
+
+static unsigned char *rx_data; // Input not yet received by the firmware
+static size_t rx_len, rx_pos;
+static int rx_fd = -1; // Polled for more input, for a terminal or the pty
+static int tx_fd = 1;
+static unsigned int baud; // Overrides the baud rate set by the firmware, 0 to follow it
+static int rx_expect_read; // RXNE was set, the next USART1_DR access is a read
+static uint64_t rx_start; // Input is held back until the firmware is up
+static uint64_t rx_next;
+static uint64_t tx_done; // 0 when idle
+static unsigned char tx_byte;
+
+static uint64_t uart_byte_ps(void)
+{
+	unsigned int div = ((USART1_BRR2 & 0xF0) << 8) | (USART1_BRR1 << 4) | (USART1_BRR2 & 0x0F);
+
+	if (baud)
+		return 10 * 1000000000000ULL / baud;
+	if (div < 16)
+		div = 16;
+	return 10 * div * CPU_PS; // Start, 8 data and stop bits
+}
+
+static void rx_queue(const char *s, size_t len)
+{
+	rx_data = realloc(rx_data, rx_len + len);
+	memcpy(rx_data + rx_len, s, len);
+	rx_len += len;
+}
+
+/* ------------------- Link statistics ------------------- */
+
+/* A request is a burst of input, it ends when the firmware starts to answer
+ * or when the line was idle for two byte times. Latency is measured from the
+ * last byte of the request to the first byte of the answer, in simulated time.
+ */
+static uint64_t req_count, req_answered;
+static uint64_t req_first, req_last; // Start of the first and last request
+static uint64_t req_last_in; // Last byte of the current request
+static int req_open;
+static uint64_t lat_sum, lat_min, lat_max;
+static uint64_t stats_every; // 0 for statistics only at exit
+static uint64_t next_stats;
+
+static void stats_rx(void)
+{
+	if (!req_open || now - req_last_in > 2 * uart_byte_ps()) {
+		if (!req_count)
+			req_first = now;
+		req_last = now;
+		req_count++;
+		req_open = 1;
+	}
+	req_last_in = now;
+}
+
+static void stats_tx(void)
+{
+	uint64_t lat = now - req_last_in;
+
+	if (!req_open)
+		return;
+	req_open = 0;
+
+	if (!req_answered || lat < lat_min)
+		lat_min = lat;
+	if (lat > lat_max)
+		lat_max = lat;
+	lat_sum += lat;
+	req_answered++;
+}
+
+static void stats_print(void)
+{
+	double span = (req_last - req_first) / 1e12;
+
+	if (!req_count)
+		return;
+
+	fprintf(stderr, "sim: %llu requests, %.1f per second, %llu answered",
+			(unsigned long long)req_count, span > 0 ? (req_count - 1) / span : 0.0,
+			(unsigned long long)req_answered);
+	if (req_answered)
+		fprintf(stderr, ", latency %.3f/%.3f/%.3f msec min/avg/max",
+				lat_min / 1e9, lat_sum / 1e9 / req_answered, lat_max / 1e9);
+	fprintf(stderr, "\n");
+}
+
+static void uart_update(void)
+{
+	if (tx_done && now >= tx_done) {
+		stats_tx();
+		if (tx_fd == 1) {
+			putchar(tx_byte);
+			if (tx_byte == '\n' || realtime)
+				fflush(stdout);
+		} else if (write(tx_fd, &tx_byte, 1) != 1) {
+			// Nobody has the pty open, the byte is lost like on a real line
+		}
+		tx_done = 0;
+		SET(USART1_SR, USART1_SR | USART_SR_TXE | USART_SR_TC);
+	}
+
+	if (now < rx_next || now < rx_start || !(USART1_CR2 & USART_CR2_REN))
+		return;
+	rx_next = now + uart_byte_ps();
+
+	if (rx_fd >= 0 && rx_pos == rx_len) {
+		char buf[64];
+		ssize_t n = read(rx_fd, buf, sizeof(buf));
+
+		if (n > 0)
+			rx_queue(buf, n);
+		else if (n == 0 && rx_fd != tx_fd)
+			rx_fd = -1; // End of file, a pty just has no client yet
+	}
+
+	if (rx_pos < rx_len) {
+		if (USART1_SR & USART_SR_RXNE)
+			SET(USART1_SR, USART1_SR | USART_SR_OR);
+		stats_rx();
+		SET(USART1_DR, rx_data[rx_pos++]);
+		SET(USART1_SR, USART1_SR | USART_SR_RXNE);
+		rx_expect_read = 1;
+	}
+}
+
+static void uart_dr_access(void)
+{
+	if (rx_expect_read) {
+		rx_expect_read = 0;
+		SET(USART1_SR, USART1_SR & ~(USART_SR_RXNE | USART_SR_OR));
+		return;
+	}
+
+	if (!(USART1_CR2 & USART_CR2_TEN))
+		return;
+
+	tx_byte = USART1_DR;
+	tx_done = now + uart_byte_ps();
+	SET(USART1_SR, USART1_SR & ~(USART_SR_TXE | USART_SR_TC));
+}
+
+/* ------------------- Timers ------------------- */
+
+static uint64_t tim4_start; // Start of the current period
+static uint64_t tim4_period;
+
+static uint64_t tim4_tick_ps(void)
+{
+	return CPU_PS << (TIM4_PSCR & 7);
+}
+
+static void tim4_begin(uint64_t at)
+{
+	tim4_start = at;
+	tim4_period = (TIM4_ARR + 1) * tim4_tick_ps(); // The preloaded reload value takes effect
+}
+
+static void tim4_update(void)
+{
+	if (!(TIM4_CR1 & TIM_CR1_CEN))
+		return;
+
+	while (now >= tim4_start + tim4_period) {
+		tim4_begin(tim4_start + tim4_period);
+		SET(TIM4_SR, TIM4_SR | TIM_SR1_UIF);
+	}
+	SET(TIM4_CNTR, (now - tim4_start) / tim4_tick_ps());
+}
+
+// Duty cycle of a PWM channel as seen by the plant, forced active is off
+static double pwm_duty(unsigned char cr1, unsigned char ccmr,
+		unsigned char arrh, unsigned char arrl, unsigned char ccrh, unsigned char ccrl)
+{
+	unsigned int top = (arrh << 8) | arrl;
+	unsigned int cmp = (ccrh << 8) | ccrl;
+
+	if (!(cr1 & TIM_CR1_CEN) || (ccmr & 0x70) != TIM_CCMR_OCM_PWM2 || top == 0)
+		return 0;
+	return cmp >= top ? 1.0 : (double)cmp / top;
+}
+
+/* ------------------- ADC ------------------- */
+
+static int adc_on;
+static uint64_t adc_done; // 0 when idle
+static uint8_t adc_channel;
+
+static int noise(void)
+{
+	noise_seed = noise_seed * 1103515245 + 12345;
+	return (int)((noise_seed >> 16) % 3) - 1;
+}
+
+static void adc_update(void)
+{
+	double v;
+	int val;
+
+	if (!adc_done || now < adc_done)
+		return;
+	adc_done = 0;
+
+	switch (adc_channel) {
+		case 2: v = plant_cout_sense(&plant); break;
+		case 3: v = plant_vout_sense(&plant); break;
+		case 4: v = plant_vin_sense(&plant); break;
+		default: v = 0; break;
+	}
+
+	val = (int)(v / 3.3 * 1023 + 0.5);
+	if (noise_seed)
+		val += noise();
+	if (val < 0)
+		val = 0;
+	if (val > 1023)
+		val = 1023;
+
+	SET(ADC1_DRH, val >> 8); // Right aligned
+	SET(ADC1_DRL, val & 0xFF);
+	SET(ADC1_CSR, ADC1_CSR | 0x80); // EOC
+
+	if (ADC1_CR1 & 0x02) { // Continuous, the next one starts right away
+		adc_channel = ADC1_CSR & 0x0F;
+		adc_done = now + ADC_PS;
+	}
+}
+
+static void adc_cr1_access(void)
+{
+	if (!(ADC1_CR1 & 1)) {
+		adc_on = 0;
+		return;
+	}
+
+	if (!adc_on) {
+		adc_on = 1; // Power up, the next ADON starts a conversion
+		return;
+	}
+
+	adc_channel = ADC1_CSR & 0x0F;
+	adc_done = now + ADC_PS;
+}
+
+/* ------------------- Flash ------------------- */
+
+#define NVM_OPT EEPROM_SIZE // Indexes of the option bytes and program flash
+#define NVM_FLASH (EEPROM_SIZE + OPT_SIZE)
+
+static unsigned char nvm_committed[EEPROM_SIZE + OPT_SIZE + FLASH_SIZE];
+static uint64_t nvm_busy; // Programming ends, 0 when idle
+static int dukr_stage;
+static int pukr_stage;
+
+static unsigned char *nvm(int i)
+{
+	if (i < NVM_OPT)
+		return &sim_mem[EEPROM_START + i];
+	if (i < NVM_FLASH)
+		return &sim_mem[OPT_START + i - NVM_OPT];
+	return &sim_mem[FLASH_START + i - NVM_FLASH];
+}
+
+static int nvm_locked(int i)
+{
+	if (i >= NVM_FLASH)
+		return !(FLASH_IAPSR & FLASH_IAPSR_PUL);
+	if (i >= NVM_OPT && !(FLASH_CR2 & FLASH_CR2_OPT))
+		return 1;
+	return !(FLASH_IAPSR & FLASH_IAPSR_DUL);
+}
+
+/* Called when FLASH_IAPSR is read, programs whatever the firmware wrote to the
+ * data EEPROM, option bytes or program flash since. Writes while locked are
+ * only undone here. Word or byte programming takes the same time everywhere.
+ */
+static void nvm_check(void)
+{
+	int i, changed = 0;
+
+	if (nvm_busy) {
+		if (now < nvm_busy)
+			return;
+		nvm_busy = 0;
+		SET(FLASH_IAPSR, FLASH_IAPSR | FLASH_IAPSR_EOP);
+		return;
+	}
+
+	for (i = 0; i < (int)sizeof(nvm_committed); i++) {
+		if (*nvm(i) == nvm_committed[i])
+			continue;
+
+		if (nvm_locked(i)) {
+			*nvm(i) = nvm_committed[i];
+			SET(FLASH_IAPSR, FLASH_IAPSR | FLASH_IAPSR_WR_PG_DIS);
+			continue;
+		}
+
+		nvm_committed[i] = *nvm(i);
+		changed = 1;
+	}
+
+	if (changed)
+		nvm_busy = now + EEPROM_PS;
+}
+
+static void iapsr_write(unsigned char old, unsigned char val)
+{
+	// EOP and WR_PG_DIS clear when read, DUL and PUL can only be cleared
+	unsigned char sr = old & ~(FLASH_IAPSR_EOP | FLASH_IAPSR_WR_PG_DIS);
+
+	if (!(val & FLASH_IAPSR_DUL))
+		sr &= ~FLASH_IAPSR_DUL;
+	if (!(val & FLASH_IAPSR_PUL))
+		sr &= ~FLASH_IAPSR_PUL;
+	SET(FLASH_IAPSR, sr);
+}
+
+static void dukr_write(unsigned char val)
+{
+	if (val == 0xAE) {
+		dukr_stage = 1;
+		return;
+	}
+
+	if (val == 0x56 && dukr_stage)
+		SET(FLASH_IAPSR, FLASH_IAPSR | FLASH_IAPSR_DUL);
+	dukr_stage = 0;
+}
+
+// The program flash keys come the other way round
+static void pukr_write(unsigned char val)
+{
+	if (val == 0x56) {
+		pukr_stage = 1;
+		return;
+	}
+
+	if (val == 0xAE && pukr_stage)
+		SET(FLASH_IAPSR, FLASH_IAPSR | FLASH_IAPSR_PUL);
+	pukr_stage = 0;
+}
+
+/* ------------------- Watchdog ------------------- */
+
+static uint64_t iwdg_deadline; // 0 when disabled
+
+static void iwdg_write(unsigned char val)
+{
+	uint64_t p = 4ULL << (IWDG_PR & 7);
+	uint64_t r = IWDG_RLR + 1ULL;
+
+	if (val == 0xCC || (val == 0xAA && iwdg_deadline))
+		iwdg_deadline = now + 2 * p * r * (PS_PER_MS / 128); // LSI at 128 kHz
+}
+
+/* ------------------- Plant and pins ------------------- */
+
+static void plant_update(void)
+{
+	int cc = plant.cc;
+
+	plant.enable = !(PB_ODR & (1<<4)); // PB4 low enables the output
+	plant.vduty = pwm_duty(TIM2_CR1, TIM2_CCMR1, TIM2_ARRH, TIM2_ARRL, TIM2_CCR1H, TIM2_CCR1L);
+	plant.cduty = (TIM1_BKR & TIM_BKR_MOE) ?
+		pwm_duty(TIM1_CR1, TIM1_CCMR1, TIM1_ARRH, TIM1_ARRL, TIM1_CCR1H, TIM1_CCR1L) : 0;
+	plant_step(&plant, PLANT_PS / 1e12);
+
+	// PB5 is the CV/CC sense line, an external interrupt and the TIM1 break input
+	SET(PB_IDR, plant.cc ? (PB_IDR | (1<<5)) : (PB_IDR & ~(1<<5)));
+
+	if (cc != plant.cc && (PB_CR2 & (1<<5)))
+		exti_pending = 1;
+
+	if ((TIM1_BKR & TIM_BKR_BKE) && plant.cc == !!(TIM1_BKR & TIM_BKR_BKP)) {
+		SET(TIM1_BKR, TIM1_BKR & ~TIM_BKR_MOE);
+		SET(TIM1_SR1, TIM1_SR1 | TIM_SR1_BIF);
+	}
+}
+
+static void button(int n, int down)
+{
+	if (n == 1)
+		SET(PC_IDR, down ? (PC_IDR & ~(1<<7)) : (PC_IDR | (1<<7)));
+	else if (n == 2)
+		SET(PD_IDR, down ? (PD_IDR & ~(1<<1)) : (PD_IDR | (1<<1)));
+}
+
+/* ------------------- Script ------------------- */
+
+/* Each line is "<msec> <text>" to send the text to the UART, where \r, \n and
+ * \\ are the only escapes, or one of
+ *   <msec> !vin <V>
+ *   <msec> !load <Ohm>          0 for open circuit
+ *   <msec> !button <1|2> <0|1>  1 is pressed
+ *   <msec> !quit
+ * Lines must be in time order, a '#' starts a comment line.
+ */
+static FILE *script;
+static uint64_t script_at;
+static char script_line[256];
+static char *script_cmd;
+
+static void script_next(void)
+{
+	char *end;
+
+	while (fgets(script_line, sizeof(script_line), script)) {
+		script_line[strcspn(script_line, "\r\n")] = 0;
+		if (script_line[0] == '#' || script_line[0] == 0)
+			continue;
+
+		script_at = (uint64_t)(strtod(script_line, &end) * PS_PER_MS);
+		script_cmd = end + strspn(end, " \t");
+		return;
+	}
+
+	fclose(script);
+	script = NULL;
+}
+
+static void script_run(void)
+{
+	char what[16];
+	double a = 0, b = 0;
+
+	if (script_cmd[0] != '!') {
+		char *in, *out;
+
+		for (in = out = script_cmd; *in; in++, out++) {
+			*out = *in;
+			if (in[0] == '\\' && in[1]) {
+				in++;
+				*out = (*in == 'r') ? '\r' : (*in == 'n') ? '\n' : *in;
+			}
+		}
+
+		if (rx_pos == rx_len)
+			rx_next = now; // Idle line, start right away
+		rx_queue(script_cmd, out - script_cmd);
+		return;
+	}
+
+	if (sscanf(script_cmd + 1, "%15s %lf %lf", what, &a, &b) < 1)
+		what[0] = 0;
+
+	if (strcmp(what, "vin") == 0)
+		plant.vin = a;
+	else if (strcmp(what, "load") == 0)
+		plant.load = a;
+	else if (strcmp(what, "button") == 0)
+		button((int)a, b != 0);
+	else if (strcmp(what, "quit") == 0)
+		sim_exit(0, "quit");
+	else
+		fprintf(stderr, "sim: unknown script command \"%s\"\n", script_cmd);
+}
+
+/* ------------------- Time ------------------- */
+
+static void trace(void)
+{
+	char text[16];
+
+	display_text(text);
+	fprintf(stderr, "%.3f,%.3f,%.3f,%.4f,%d,%d,%.4f,%.4f,%s\n",
+			now / 1e9, plant.vin, plant.vout, plant.iout, plant.cc, plant.enable,
+			plant.vduty, plant.cduty, text);
+}
+
+static void pace(void)
+{
+	struct timespec ts;
+	double ahead = now / 1e12 - wall_elapsed();
+
+	if (ahead > 0) {
+		ts.tv_sec = (time_t)ahead;
+		ts.tv_nsec = (long)((ahead - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void advance(void)
+{
+	now += ACCESS_PS;
+	accesses++;
+
+	while (now >= next_plant) {
+		plant_update();
+		next_plant += PLANT_PS;
+	}
+
+	tim4_update();
+	adc_update();
+	uart_update();
+
+	while (script && now >= script_at) {
+		script_run();
+		script_next();
+	}
+
+	if (iwdg_deadline && now >= iwdg_deadline)
+		sim_exit(3, "watchdog reset");
+
+	if (trace_every && now >= next_trace) {
+		trace();
+		next_trace += trace_every;
+	}
+
+	if (realtime && now >= next_pace) {
+		pace();
+		next_pace += PS_PER_MS;
+	}
+
+	if (stats_every && now >= next_stats) {
+		stats_print();
+		next_stats += stats_every;
+	}
+
+	if (stop_at && now >= stop_at)
+		sim_exit(0, "stopped");
+
+	if (interrupted)
+		sim_exit(0, "interrupted");
+}
+
+/* ------------------- Register access ------------------- */
+
+// Acts upon the previous access, it may have been a write
+static void access_done(void)
+{
+	unsigned int addr = pending;
+	unsigned char old, val;
+
+	if (pending < 0)
+		return;
+	pending = -1;
+
+	old = shadow[addr];
+	val = sim_mem[addr];
+	shadow[addr] = val;
+
+	if (&sim_mem[addr] == &IWDG_KR)
+		iwdg_write(val);
+	else if (&sim_mem[addr] == &FLASH_DUKR)
+		dukr_write(val);
+	else if (&sim_mem[addr] == &FLASH_PUKR)
+		pukr_write(val);
+	else if (&sim_mem[addr] == &WWDG_CR && (val & WWDG_CR_WDGA) && !(val & 0x40))
+		sim_exit(3, "software reset");
+	else if (&sim_mem[addr] == &USART1_DR)
+		uart_dr_access();
+	else if (&sim_mem[addr] == &ADC1_CR1)
+		adc_cr1_access();
+	else if (&sim_mem[addr] == &FLASH_IAPSR)
+		iapsr_write(old, val);
+	else if (&sim_mem[addr] == &TIM4_SR)
+		SET(TIM4_SR, old & val); // Cleared by writing 0
+	else if (&sim_mem[addr] == &TIM1_SR1)
+		SET(TIM1_SR1, old & val);
+	else if (&sim_mem[addr] == &TIM4_CR1 && !(old & TIM_CR1_CEN) && (val & TIM_CR1_CEN))
+		tim4_begin(now);
+	else if (&sim_mem[addr] == &PA_ODR)
+		display_pins(old, val);
+}
+
+static void interrupts(void)
+{
+	if (!irq_enabled || in_isr)
+		return;
+
+	in_isr = 1;
+	if ((TIM4_SR & TIM_SR1_UIF) && (TIM4_IER & TIM_IER_UIE)) {
+		systick_count++;
+		systick_isr();
+		access_done();
+	}
+	if (exti_pending) {
+		exti_pending = 0;
+		cvcc_count++;
+		cvcc_isr();
+		access_done();
+	}
+	if ((ADC1_CSR & 0x80) && (ADC1_CSR & 0x20)) { // EOC with EOCIE
+		adc_count++;
+		capture_isr();
+		access_done();
+	}
+	in_isr = 0;
+}
+
+unsigned char *sim_reg(unsigned int addr)
+{
+	access_done();
+	advance();
+	interrupts();
+
+	if (&sim_mem[addr] == &FLASH_IAPSR)
+		nvm_check();
+
+	pending = addr;
+	return &sim_mem[addr];
+}
+
+void sim_interrupts(unsigned char enable)
+{
+	irq_enabled = enable;
+}
+
+// Only C code runs here, the simulation ends where the firmware would jump
+void sim_jump(unsigned int addr)
+{
+	char why[32];
+
+	access_done();
+	snprintf(why, sizeof(why), "jump to 0x%04X", addr);
+	sim_exit(0, why);
+}
+
+/* ------------------- Setup ------------------- */
+
+static void reset(void)
+{
+	int i;
+
+	SET(USART1_SR, USART_SR_TXE | USART_SR_TC);
+	SET(IWDG_RLR, 0xFF);
+	SET(PB_IDR, 0);
+	SET(PC_IDR, 1<<7);
+	SET(PD_IDR, 1<<1);
+	SET(OPT2, OPT2_AFR0 | OPT2_AFR4); // As if already set by an earlier run
+	SET(NOPT2, (unsigned char)~OPT2);
+
+	for (i = 0; i < (int)sizeof(nvm_committed); i++)
+		nvm_committed[i] = *nvm(i);
+	memcpy(shadow, sim_mem, sizeof(shadow));
+
+	plant_init(&plant);
+}
+
+/* Opens a pseudo terminal for the UART, clients such as sigrok-cli or
+ * calibrate.py use the slave side like the USB serial adapter. The link is
+ * a symlink to the slave so that it has a stable name.
+ */
+static int pty_open(const char *link)
+{
+	struct termios tio;
+	const char *name;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || !(name = ptsname(fd))) {
+		perror("pty");
+		exit(2);
+	}
+
+	// Raw, whatever the client sets up later applies to the slave side
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	unlink(link);
+	if (symlink(name, link) < 0) {
+		perror(link);
+		exit(2);
+	}
+	fprintf(stderr, "sim: serial port on %s, linked from %s\n", name, link);
+
+	return fd;
+}
+
+// The link goes right away, the simulation stops at the next access
+static void on_signal(int sig)
+{
+	(void)sig;
+	if (pty_link)
+		unlink(pty_link);
+	interrupted = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t <msec>    Stop after the given simulated time\n"
+		"  -e <file>    Data EEPROM image, loaded at start and saved at exit\n"
+		"  -f <file>    Program flash image, the same, for the bootloader\n"
+		"  -x <file>    Script of timed input and plant changes, see sim.c\n"
+		"  -p <msec>    Print the plant state to stderr at this interval\n"
+		"  -v <V>       Input voltage, default 12\n"
+		"  -l <Ohm>     Load, default 100, 0 for open circuit\n"
+		"  -n <seed>    ADC noise seed, 0 for no noise\n"
+		"  -R           Run in real time\n"
+		"  -P <link>    Connect the UART to a pty linked from <link>, implies -R\n"
+		"  -b <baud>    Emulate this baud rate rather than the one set by the firmware\n"
+		"  -S <sec>     Print request statistics at this interval\n"
+		"Without -P standard input is sent to the UART and the UART output goes to\n"
+		"standard output.\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	double vin = 12, load = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:e:f:x:p:v:l:n:RP:b:S:")) != -1) {
+		switch (opt) {
+			case 't': stop_at = (uint64_t)(atof(optarg) * PS_PER_MS); break;
+			case 'e': eeprom_file = optarg; break;
+			case 'f': flash_file = optarg; break;
+			case 'x':
+				script = fopen(optarg, "r");
+				if (!script) {
+					perror(optarg);
+					return 2;
+				}
+				break;
+			case 'p': trace_every = (uint64_t)(atof(optarg) * PS_PER_MS); break;
+			case 'v': vin = atof(optarg); break;
+			case 'l': load = atof(optarg); break;
+			case 'n': noise_seed = strtoul(optarg, NULL, 0); break;
+			case 'R': realtime = 1; break;
+			case 'P': pty_link = optarg; realtime = 1; break;
+			case 'b': baud = atoi(optarg); break;
+			case 'S': stats_every = (uint64_t)(atof(optarg) * 1000 * PS_PER_MS); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	image_load_file(eeprom_file, EEPROM_START, EEPROM_SIZE);
+	image_load_file(flash_file, FLASH_START, FLASH_SIZE);
+	reset();
+	plant.vin = vin;
+	plant.load = load;
+
+	/* Input piped in is read up front so that runs are repeatable, a terminal
+	 * is polled as the simulation goes. Either way it is held back until the
+	 * firmware had a chance to start.
+	 */
+	rx_start = 50 * PS_PER_MS;
+	if (pty_link) {
+		rx_fd = tx_fd = pty_fd = pty_open(pty_link);
+	} else if (isatty(0)) {
+		rx_fd = 0;
+		fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+		if (!realtime)
+			fprintf(stderr, "sim: reading a terminal without -R\n");
+	} else {
+		char buf[256];
+		size_t n;
+
+		while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+			rx_queue(buf, n);
+	}
+
+	if (script)
+		script_next();
+	next_stats = stats_every;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (trace_every)
+		fprintf(stderr, "msec,vin,vout,iout,cc,enable,vduty,cduty,display\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	firmware_main();
+	sim_exit(1, "firmware returned");
+	return 1;
+}
@@ -0,0 +1,38 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+/* Host simulation of the B3603. The firmware is built with SIM=1, every
+ * register access in stm8s.h goes through sim_reg() which advances simulated
+ * time, runs the peripherals and the plant and calls interrupt handlers. The
+ * data EEPROM, option bytes and program flash live in sim_mem at their real
+ * addresses.
+ *
+ * Only this header is shared with the firmware, which is built with
+ * -fpack-struct to match the target layout, so it declares no structs.
+ */
+
+extern unsigned char sim_mem[0x10000];
+
+unsigned char *sim_reg(unsigned int addr);
+void sim_interrupts(unsigned char enable);
+void sim_jump(unsigned int addr);
+
+#endif
@@ -0,0 +1,137 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include "uart.h"
+
+/* Running statistics of the calibrated readings, updated on every ADC result.
+ * The sum of squares needs more than 32 bits, 65535 full scale readings take
+ * 48, so it is kept as a 32 bit low part and a 16 bit carry.
+ */
+#define STATS_CHANNELS 3
+
+typedef struct {
+	uint16_t count;
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint32_t sumsq_lo;
+	uint16_t sumsq_hi;
+} stats_t;
+
+static stats_t stats[STATS_CHANNELS];
+static uint16_t window; // Samples per channel, 0 until the next query
+
+static void stats_reset(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < STATS_CHANNELS; i++) {
+		stats[i].count = 0;
+		stats[i].min = 0xFFFF;
+		stats[i].max = 0;
+		stats[i].sum = 0;
+		stats[i].sumsq_lo = 0;
+		stats[i].sumsq_hi = 0;
+	}
+}
+
+void stats_update(uint8_t channel, uint16_t val)
+{
+	stats_t *st = &stats[channel];
+	uint32_t sq;
+
+	// A full window is held until it is read, as is a counter about to wrap
+	if (st->count == 0xFFFF || (window && st->count >= window))
+		return;
+
+	if (st->count == 0)
+		st->min = 0xFFFF; // Before the first query nothing reset it
+
+	st->count++;
+	if (val < st->min)
+		st->min = val;
+	if (val > st->max)
+		st->max = val;
+	st->sum += val;
+
+	sq = (uint32_t)val * val;
+	st->sumsq_lo += sq;
+	if (st->sumsq_lo < sq)
+		st->sumsq_hi++;
+}
+
+void stats_window(uint16_t samples)
+{
+	window = samples;
+	stats_reset();
+}
+
+// Decimal 48 bit number, by long division of three 16 bit limbs
+static void write_uint48(uint16_t hi, uint32_t lo)
+{
+	uint16_t limb[3];
+	char digits[15];
+	uint8_t n = 0;
+	uint8_t i;
+	uint32_t cur;
+
+	limb[0] = hi;
+	limb[1] = lo >> 16;
+	limb[2] = lo;
+
+	do {
+		cur = 0;
+		for (i = 0; i < 3; i++) {
+			cur = (cur << 16) | limb[i];
+			limb[i] = cur / 10;
+			cur %= 10;
+		}
+		digits[n++] = '0' + cur;
+	} while (limb[0] || limb[1] || limb[2]);
+
+	while (n > 0)
+		uart_write_ch(digits[--n]);
+}
+
+/* One "<count>,<min>,<max>,<sum>,<sum of squares>" line each for Vout, Iout
+ * and Vin, then everything starts over. Parsing and the updates both run from
+ * the main loop, so no reading can slip in between the two.
+ */
+void stats_report(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < STATS_CHANNELS; i++) {
+		stats_t *st = &stats[i];
+
+		if (i)
+			uart_write_str("\r\n");
+		uart_write_int(st->count);
+		uart_write_ch(',');
+		uart_write_int(st->count ? st->min : 0);
+		uart_write_ch(',');
+		uart_write_int(st->max);
+		uart_write_ch(',');
+		uart_write_int32(st->sum);
+		uart_write_ch(',');
+		write_uint48(st->sumsq_hi, st->sumsq_lo);
+	}
+
+	stats_reset();
+}
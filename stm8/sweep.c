@@ -0,0 +1,161 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sweep.h"
+#include "outputs.h"
+#include "regulate.h"
+#include "systick.h"
+#include "uart.h"
+
+extern cfg_system_t cfg_system;
+
+void commit_output(void);
+
+/* Calibration sweep. The compare value of one channel is stepped from first
+ * to last with the output on, the other channel keeps its setpoint. Every
+ * step waits for the output to settle, then averages the raw ADC readings for
+ * as long again. The host samples its reference meter in that window, it
+ * starts with "S<compare>" and ends with "<compare>,<vout_raw>,<cout_raw>,
+ * <vin_raw>", the sweep ends with "END" or "ABORT" and the setpoints and
+ * output state from before are restored.
+ */
+#define PHASE_SETTLE 0
+#define PHASE_MEASURE 1
+
+static uint16_t params[4] = { 0, 0x2000, 0x100, 200 };
+static uint8_t channel;
+static uint8_t phase;
+static uint8_t was_on;
+static uint16_t ctr;
+static uint32_t phase_start;
+static uint32_t sum_vout, sum_cout, sum_vin;
+static uint8_t samples;
+
+void sweep_param(uint8_t param, uint16_t val)
+{
+	params[param] = val;
+}
+
+static void sweep_step(void)
+{
+	output_raw(channel, ctr);
+	phase = PHASE_SETTLE;
+	phase_start = systick_now();
+}
+
+void sweep_start(uint8_t ch)
+{
+	if (channel)
+		sweep_stop();
+
+	was_on = cfg_system.output;
+	cfg_system.output = 1;
+#if FEATURE_REGULATE
+	regulate_mode(REGULATE_CVCC); // Commits the output
+#else
+	commit_output();
+#endif
+
+	channel = ch;
+	ctr = params[SWEEP_FIRST];
+	sweep_step();
+}
+
+static void sweep_end(const char *how)
+{
+	channel = SWEEP_IDLE;
+	uart_write_str(how);
+
+	cfg_system.output = was_on;
+	commit_output(); // Back to the setpoints
+}
+
+void sweep_stop(void)
+{
+	if (channel)
+		sweep_end("ABORT\r\n");
+}
+
+void sweep_update(void)
+{
+	uint32_t now;
+
+	if (!channel)
+		return;
+
+	if (!cfg_system.output) {
+		sweep_end("ABORT\r\n"); // Turned off or tripped
+		return;
+	}
+
+	now = systick_now();
+	if (now - phase_start < params[SWEEP_SETTLE])
+		return;
+	phase_start = now;
+
+	if (phase == PHASE_SETTLE) {
+		phase = PHASE_MEASURE;
+		sum_vout = 0;
+		sum_cout = 0;
+		sum_vin = 0;
+		samples = 0;
+		uart_write_ch('S');
+		uart_write_int(ctr);
+		uart_write_str("\r\n");
+		return;
+	}
+
+	if (samples) {
+		uart_write_int(ctr);
+		uart_write_ch(',');
+		uart_write_int(sum_vout / samples);
+		uart_write_ch(',');
+		uart_write_int(sum_cout / samples);
+		uart_write_ch(',');
+		uart_write_int(sum_vin / samples);
+		uart_write_str("\r\n");
+	}
+
+	if (!params[SWEEP_STEP] || ctr >= params[SWEEP_LAST] || params[SWEEP_LAST] - ctr < params[SWEEP_STEP]) {
+		sweep_end("END\r\n");
+		return;
+	}
+
+	ctr += params[SWEEP_STEP];
+	sweep_step();
+}
+
+// Called at the end of every round of ADC readings
+void sweep_sample(state_t *st)
+{
+	if (!channel || phase != PHASE_MEASURE || samples == 255)
+		return;
+
+	sum_vout += st->vout_raw;
+	sum_cout += st->cout_raw;
+	sum_vin += st->vin_raw;
+	samples++;
+}
+
+// "<channel>,<compare>"
+void sweep_report(void)
+{
+	uart_write_int(channel);
+	uart_write_ch(',');
+	uart_write_int(channel ? ctr : 0);
+}
@@ -0,0 +1,49 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "outputs.h"
+
+#define SWEEP_IDLE 0
+#define SWEEP_VOUT OUTPUT_VOUT
+#define SWEEP_COUT OUTPUT_COUT
+
+#define SWEEP_FIRST 0
+#define SWEEP_LAST 1
+#define SWEEP_STEP 2
+#define SWEEP_SETTLE 3
+
+#if FEATURE_SWEEP
+void sweep_param(uint8_t param, uint16_t val);
+void sweep_start(uint8_t channel);
+void sweep_stop(void);
+void sweep_update(void);
+void sweep_sample(state_t *st);
+void sweep_report(void);
+#else
+// Built without the calibration sweep, see FEATURES in the Makefile
+#define sweep_update()
+#define sweep_sample(st)
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "systick.h"
+#include "display.h"
+#include "buttons.h"
+#include "stm8s.h"
+
+static volatile uint32_t ticks;
+
+void systick_init(void)
+{
+	TIM4_PSCR = 6; // 16MHz / 64 = 250kHz
+	TIM4_ARR = 249; // Update every 250 counts = 1 msec
+	TIM4_IER = TIM_IER_UIE;
+	TIM4_CR1 = TIM_CR1_APRE | TIM_CR1_CEN; // The display changes the reload value, see display_multiplex()
+}
+
+/* The tick is only written from the timer interrupt, reading it again until
+ * two reads agree is enough to avoid a torn value and works the same from the
+ * main loop and from inside other interrupt handlers.
+ */
+uint32_t systick_now(void)
+{
+	uint32_t now;
+
+	do {
+		now = ticks;
+	} while (now != ticks);
+
+	return now;
+}
+
+void systick_isr(void) INTERRUPT(TIM4_UPD_IRQ)
+{
+	TIM4_SR = 0;
+
+	// The buttons are read through the digit lines, see buttons.c
+	buttons_sample();
+
+	// The display may split a tick in two interrupts
+	if (display_multiplex()) {
+		ticks++;
+		if (((uint8_t)ticks & 3) == 0)
+			buttons_tick();
+	}
+}
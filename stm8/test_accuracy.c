@@ -0,0 +1,111 @@
+/* Copyright (C) 2015 Baruch Even
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Shared by test_adc_accuracy.c and test_pwm_accuracy.c, included after the
+ * sources under test. Sweeps every input of a conversion for the given
+ * calibrations and a set of extreme and random ones against a double
+ * precision reference. The result must be the reference correctly rounded
+ * and saturated to 0..0xFFFF so the error never exceeds half a count.
+ */
+
+typedef uint16_t (*accuracy_fn_t)(uint16_t x, calibrate_t *cal);
+typedef double (*accuracy_ref_t)(uint16_t x, calibrate_t *cal);
+
+typedef struct {
+	const char *name;
+	calibrate_t *cal;
+} accuracy_cal_t;
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) ^ (seed << 16);
+}
+
+static double clamp(double ref)
+{
+	return ref < 0 ? 0 : (ref > 0xFFFF ? 0xFFFF : ref);
+}
+
+static int sweep(accuracy_fn_t fn, accuracy_ref_t ref, const char *name, calibrate_t *cal, int verbose)
+{
+	double err, max_err = 0;
+	uint32_t x, worst = 0;
+
+	for (x = 0; x <= 0xFFFF; x++) {
+		err = fn(x, cal) - clamp(ref(x, cal));
+		if (err < 0)
+			err = -err;
+		if (err > max_err) {
+			max_err = err;
+			worst = x;
+		}
+	}
+
+	if (verbose || max_err > 0.5)
+		printf("%-10s a=0x%08x b=0x%08x max error %.4f at %u%s\n", name, cal->a, cal->b,
+				max_err, worst, max_err > 0.5 ? " FAIL" : "");
+	return max_err > 0.5;
+}
+
+/* Runs the sweeps and times fn on the first calibration, returns the exit
+ * code for main(), 1 on any error above half a count.
+ */
+static int accuracy_run(accuracy_fn_t fn, accuracy_ref_t ref, const accuracy_cal_t *cals, int ncals)
+{
+	static calibrate_t extremes[] = {
+		{ 0, 0 }, { 1, 0 }, { 0x10000, 0x8000 }, { 0xFFFFFFFF, 0 },
+		{ 0xFFFFFFFF, 0xFFFFFFFF }, { 0x12345678, 0x9ABCDEF0 }, { 0x0000FFFF, 0x00017FFF },
+	};
+	struct timespec t0, t1;
+	calibrate_t cal;
+	volatile uint16_t sink;
+	uint32_t x;
+	int i, fails = 0;
+
+	for (i = 0; i < ncals; i++)
+		fails += sweep(fn, ref, cals[i].name, cals[i].cal, 1);
+
+	for (i = 0; i < (int)(sizeof(extremes)/sizeof(extremes[0])); i++)
+		fails += sweep(fn, ref, "extreme", &extremes[i], 1);
+
+	for (i = 0; i < 200; i++) {
+		cal.a = rnd() >> (rnd() & 31);
+		cal.b = rnd() >> (rnd() & 31);
+		fails += sweep(fn, ref, "random", &cal, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < 100; i++)
+		for (x = 0; x <= 0xFFFF; x++)
+			sink = fn(x, cals[0].cal);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	(void)sink;
+
+	printf("%.1f nsec per call on the host, see make bench for STM8 cycles\n",
+			((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / (100.0 * 0x10000));
+	printf("%s, %d calibrations out of bounds\n", fails ? "FAIL" : "PASS", fails);
+
+	return fails ? 1 : 0;
+}
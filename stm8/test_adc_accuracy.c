@@ -20,6 +20,7 @@
 
 void uart_write_ch(const char ch) { (void)ch; }
 void uart_write_str(const char *s) { (void)s; }
+void event_log(uint8_t code, uint16_t arg) { (void)code; (void)arg; }
 
 
 #include "fixedpoint.c"
@@ -27,19 +28,24 @@ void uart_write_str(const char *s) { (void)s; }
 #include "eeprom.c"
 #include "config.c"
 
-#include <stdio.h>
+#include "test_accuracy.c"
+
+// x*a - b, the helper clamps it to 0..0xFFFF
+static double reference(uint16_t x, calibrate_t *cal)
+{
+	return ((double)x * cal->a - cal->b) / 65536.0;
+}
 
 int main()
 {
-	uint16_t adc;
-	uint16_t mvolt;
 	cfg_system_t sys;
+	accuracy_cal_t cals[] = {
+		{ "vin_adc", &sys.vin_adc },
+		{ "vout_adc", &sys.vout_adc },
+		{ "cout_adc", &sys.cout_adc },
+	};
 
 	config_load_system(&sys);
 
-	for (adc = 0; adc < 8192; adc++) {
-		mvolt = adc_to_volt(adc, &(sys.vin_adc));
-		printf("%u %u %u.%03u\n", adc, mvolt, mvolt/1000, mvolt%1000);
-	}
-	return 0;
+	return accuracy_run(adc_to_volt, reference, cals, sizeof(cals)/sizeof(cals[0]));
 }
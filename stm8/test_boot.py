@@ -0,0 +1,118 @@
+#!/usr/bin/python
+
+# Runs the bootloader in the simulator (make b3603-boot-sim) and uploads to it
+# with upload.py over the pty: a good image is programmed and started, a unit
+# with a valid image starts it after the window, and a bad block, a wrong
+# image CRC or an upload cut short leave it in the bootloader.
+
+import os
+import sys
+import time
+import random
+import tempfile
+import subprocess
+
+import upload
+
+SIM = './b3603-boot-sim'
+
+failed = False
+
+def check(name, ok):
+    global failed
+    print '%-40s %s' % (name, 'ok' if ok else 'FAIL')
+    if not ok:
+        failed = True
+
+class Sim(object):
+    def __init__(self, flash, link=None, msec=None):
+        args = [SIM, '-f', flash]
+        if link:
+            args += ['-P', link]
+        if msec:
+            args += ['-t', str(msec)]
+        self.err = tempfile.TemporaryFile()
+        self.p = subprocess.Popen(args, stdin=open(os.devnull), stdout=open(os.devnull, 'w'), stderr=self.err)
+        if link:
+            end = time.time() + 5
+            while not os.path.exists(link) and time.time() < end:
+                time.sleep(0.01)
+
+    def wait(self, timeout=30):
+        end = time.time() + timeout
+        while self.p.poll() is None and time.time() < end:
+            time.sleep(0.01)
+        if self.p.poll() is None:
+            self.p.terminate()
+            self.p.wait()
+        self.err.seek(0)
+        return self.err.read()
+
+    def stop(self):
+        if self.p.poll() is None:
+            self.p.terminate()
+        return self.wait()
+
+def flash_image(flash, size):
+    data = bytearray(open(flash, 'rb').read())
+    start = upload.BOOT_APP_START - upload.BOOT_START
+    return data[start:start + size]
+
+def main():
+    tmp = tempfile.mkdtemp()
+    flash = os.path.join(tmp, 'flash.bin')
+    link = os.path.join(tmp, 'tty')
+    rnd = random.Random(3603)
+    image = bytearray(rnd.randrange(256) for i in range(1500))
+
+    # Erased flash, the bootloader waits for an upload
+    sim = Sim(flash, link)
+    bl = upload.Bootloader(link)
+    bl.enter(reset=False)
+
+    bad = upload.be16(0) + bytearray([4]) + image[:4]
+    check('block with a bad CRC refused', not bl.command(bytearray('W') + bad + upload.be16(upload.crc16(bad) ^ 1)))
+    check('unaligned block refused', not bl.command(bytearray('W') + bad[:1] + bytearray([2]) + bad[2:] +
+            upload.be16(upload.crc16(bad[:1] + bytearray([2]) + bad[2:]))))
+    bl.erase()
+    for offset in range(0, len(image), upload.BOOT_BLOCK):
+        bl.write(offset, image[offset:offset + upload.BOOT_BLOCK])
+    check('wrong image CRC refused', not bl.verify(image[:-4] + bytearray(4)))
+    check('no start without a valid image', not bl.go())
+    check('image verified', bl.verify(image))
+    check('image started', bl.go())
+    bl.close()
+    out = sim.wait()
+    check('jump to the application', 'jump to 0x%04X' % upload.BOOT_APP_START in out)
+    check('flash holds the image', flash_image(flash, len(image)) == image)
+
+    # A valid image is started after the window
+    out = Sim(flash, msec=1000).wait()
+    check('valid image started at reset', 'jump to' in out)
+
+    # An upload cut short, the old image must not be started any more
+    sim = Sim(flash, link)
+    bl = upload.Bootloader(link)
+    bl.enter(reset=False)
+    bl.erase()
+    bl.write(0, image[:upload.BOOT_BLOCK])
+    bl.close()
+    sim.stop()
+    out = Sim(flash, msec=1000).wait()
+    check('interrupted upload stays in bootloader', 'stopped' in out and 'jump to' not in out)
+
+    # And the upload can be done again from there
+    sim = Sim(flash, link)
+    bl = upload.Bootloader(link)
+    bl.enter(reset=False)
+    bl.upload(image)
+    bl.close()
+    check('second upload started', 'jump to' in sim.wait())
+
+    for name in os.listdir(tmp):
+        os.unlink(os.path.join(tmp, name))
+    os.rmdir(tmp)
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -26,6 +26,7 @@ void uart_write_str(const char *s) { (void)s; }
 #include <stdio.h>
 
 #define TEST_PARSE(s, expected) if (parse_millinum((uint8_t*)s) != expected) { printf("Parsing of %s yielded %u but expected %u\n", s, parse_millinum((uint8_t*)s), expected);}
+#define TEST_PARSE_CENTI(s, expected) if (parse_centinum((uint8_t*)s) != expected) { printf("Parsing of %s yielded %u but expected %u\n", s, parse_centinum((uint8_t*)s), expected);}
 
 int main()
 {
@@ -48,5 +49,17 @@ int main()
 	TEST_PARSE("0.900", 900);
 	TEST_PARSE("9.999", 9999);
 
+	TEST_PARSE("62.999", 62999);
+	TEST_PARSE("63", 0xFFFF);
+	TEST_PARSE("1.0001", 0xFFFF);
+
+	TEST_PARSE_CENTI("5", 500);
+	TEST_PARSE_CENTI("5.5", 550);
+	TEST_PARSE_CENTI("0.01", 1);
+	TEST_PARSE_CENTI("108.00", 10800);
+	TEST_PARSE_CENTI("654.99", 65499);
+	TEST_PARSE_CENTI("655", 0xFFFF);
+	TEST_PARSE_CENTI("1.001", 0xFFFF);
+
 	return 0;
 }
@@ -0,0 +1,207 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host simulation of the power failure detector. The input capacitors are
+ * modelled as discharging into a constant power load once the supply goes
+ * away, the detector is fed a probe every PROBE_USEC and the snapshot must be
+ * started with enough charge left to finish writing before Vin reaches
+ * VIN_MIN_MV.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+// The snapshot and the event record are part of what is checked
+#define FEATURE_ENERGY 1
+#define FEATURE_EVENTS 1
+
+#include "config.h"
+
+cfg_system_t cfg_system;
+cfg_output_t cfg_output;
+state_t state;
+
+static int tripped;
+static int saved;
+static uint8_t flags;
+
+void commit_output(void)
+{
+	if (!cfg_system.output)
+		tripped = 1;
+}
+void energy_snapshot(void) {}
+void energy_save(void) { saved++; }
+uint8_t config_set_output_flags(cfg_output_t *cfg, uint8_t f) { (void)cfg; flags = f; return 1; }
+void eeprom_flush(void) {}
+void event_log(uint8_t code, uint16_t arg) { (void)code; (void)arg; }
+void event_save(void) {}
+
+#include "powerfail.c"
+
+#define PROBE_USEC 300 // 8 conversions and one probe
+#define CAP_UF 470
+#define LOAD_MW 15000 // 12V 1A out of the buck
+#define IDLE_MA 25 // MCU, display and regulator once the output is off
+#define WRITE_MSEC (8*6) // 8 word writes, 6msec each
+#define VIN_MIN_MV 4500
+
+static double vin;
+static int failed;
+
+static void reset(double v)
+{
+	vin = v;
+	tripped = 0;
+	saved = 0;
+	flags = 0;
+	pf_state = PF_IDLE;
+	pf_count = 0;
+	avg_acc = 0;
+	cfg_system.output = 1;
+}
+
+// Step the model by one probe period, the supply holds Vin at src if src > 0
+static void step(double src, double ripple)
+{
+	double dt = PROBE_USEC / 1e6;
+	double amps;
+
+	if (src > 0) {
+		vin = src;
+	} else {
+		amps = tripped ? IDLE_MA / 1000.0 : LOAD_MW / 1000.0 / vin;
+		vin -= amps * dt / (CAP_UF / 1e6);
+		if (vin < 0)
+			vin = 0;
+	}
+
+	powerfail_update((vin + ripple) * 1000);
+}
+
+static void check(const char *name, int ok)
+{
+	printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok)
+		failed = 1;
+}
+
+static void test_collapse(void)
+{
+	int i;
+	double left;
+
+	reset(12.0);
+	for (i = 0; i < 100; i++)
+		step(12.0, 0);
+	for (i = 0; i < 1000 && !tripped; i++)
+		step(0, 0);
+
+	printf("tripped at %.2fV after %.1fms\n", vin, i * PROBE_USEC / 1000.0);
+
+	// The output is off now, run the hold-up for the duration of the writes
+	for (i = 0; i < WRITE_MSEC * 1000 / PROBE_USEC; i++)
+		step(0, 0);
+	left = vin;
+	printf("Vin after the snapshot is written %.2fV\n", left);
+
+	check("collapse trips", tripped);
+	check("output restored at the next boot", flags == OUTPUT_FLAG_RESTORE);
+	check("snapshot completes above VIN_MIN_MV", left * 1000 > VIN_MIN_MV);
+}
+
+static void test_noise(void)
+{
+	int i;
+
+	reset(12.0);
+	for (i = 0; i < 100000; i++)
+		step(12.0, ((i * 7919) % 401 - 200) / 1000.0); // +-200mV
+	check("no trip on noisy Vin", !tripped);
+
+	// Bench supply turned down by hand, 12V to 7V over a second
+	for (i = 0; i < 3333; i++)
+		step(12.0 - 5.0 * i / 3333, 0);
+	check("no trip on slow ramp", !tripped);
+
+	// A single glitch is not enough
+	step(7.0, -2.0);
+	step(7.0, 0);
+	check("no trip on a single glitch", !tripped);
+
+	// Below the floor it trips however slowly we got there
+	for (i = 0; i < 1000 && !tripped; i++)
+		step(7.0 - 2.0 * i / 1000, 0);
+	check("trip below the floor", tripped && vin * 1000 < PF_FLOOR);
+}
+
+/* The output current steps up and the supply sags with it. A bench supply dips
+ * and its regulation pulls it back within a millisecond, a wall adapter stays
+ * down by its output resistance times the extra current.
+ */
+static void test_load_step(void)
+{
+	int i;
+	double t;
+
+	reset(12.0);
+	for (i = 0; i < 100; i++)
+		step(12.0, 0);
+	for (i = 0; i < 1000; i++) {
+		t = i * PROBE_USEC / 1000.0;
+		step(12.0 - 0.2 - 3.0 * exp(-t / 0.5), 0); // 3V dip, 0.5msec to recover
+	}
+	check("no trip on a bench supply load step", !tripped);
+
+	reset(9.0);
+	for (i = 0; i < 100; i++)
+		step(9.0, 0);
+	for (i = 0; i < 1000; i++)
+		step(9.0 - 0.8 * 1.5, ((i * 7919) % 201 - 100) / 1000.0); // 0.8 Ohm, 0.3A to 1.8A
+	check("no trip on a wall adapter load step", !tripped);
+}
+
+static void test_recover(void)
+{
+	int i;
+
+	reset(12.0);
+	for (i = 0; i < 100; i++)
+		step(12.0, 0);
+	for (i = 0; i < 1000 && !tripped; i++)
+		step(0, 0);
+	check("dip trips", tripped);
+
+	// The supply comes back before we died
+	for (i = 0; i < PF_RECOVER - 1; i++)
+		step(12.0, 0);
+	check("not rearmed too early", pf_state == PF_TRIPPED && saved == 0);
+	step(12.0, 0);
+	check("rearmed and snapshot cleared", pf_state == PF_ARMED && saved == 1 && flags == 0);
+}
+
+int main()
+{
+	test_collapse();
+	test_noise();
+	test_load_step();
+	test_recover();
+
+	return failed;
+}
@@ -20,26 +20,32 @@
 
 void uart_write_ch(const char ch) { (void)ch; }
 void uart_write_str(const char *s) { (void)s; }
+void event_log(uint8_t code, uint16_t arg) { (void)code; (void)arg; }
 void uart_write_int(uint16_t v) { (void)v; }
 
+
 #include "fixedpoint.c"
 #include "outputs.c"
 #include "eeprom.c"
 #include "config.c"
 
-#include <stdio.h>
+#include "test_accuracy.c"
+
+// x*a + b, the helper clamps it to 0..0xFFFF
+static double reference(uint16_t x, calibrate_t *cal)
+{
+	return ((double)x * cal->a + cal->b) / 65536.0;
+}
 
 int main()
 {
-	uint16_t val;
-	uint16_t pwm;
 	cfg_system_t sys;
+	accuracy_cal_t cals[] = {
+		{ "vout_pwm", &sys.vout_pwm },
+		{ "cout_pwm", &sys.cout_pwm },
+	};
 
 	config_load_system(&sys);
 
-	for (val = 10; val < 35000; val+=10) {
-		pwm = pwm_from_set(val, &(sys.vout_pwm));
-		printf("%u %u.%03u %u %.2f\n", val, val/1000, val % 1000, pwm, ((double)pwm)/8191.0*100.0);
-	}
-	return 0;
+	return accuracy_run(pwm_from_set, reference, cals, sizeof(cals)/sizeof(cals[0]));
 }
@@ -0,0 +1,104 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks the running statistics against sums done in 64 bits, over full scale
+ * readings until the 32 bit sum of squares has carried several times.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+static char out[256];
+static int outlen;
+
+void uart_write_ch(const char ch) { if (outlen < (int)sizeof(out) - 1) out[outlen++] = ch; }
+void uart_write_str(const char *str) { while (*str) uart_write_ch(*str++); }
+void uart_write_int(uint16_t val) { outlen += snprintf(out + outlen, sizeof(out) - outlen, "%u", val); }
+void uart_write_int32(uint32_t val) { outlen += snprintf(out + outlen, sizeof(out) - outlen, "%" PRIu32, val); }
+
+#define FEATURE_STATS 1
+#include "stats.c"
+
+static int failed;
+
+static void check(const char *name, int ok)
+{
+	printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok)
+		failed = 1;
+}
+
+static void report(void)
+{
+	outlen = 0;
+	stats_report();
+	out[outlen] = 0;
+}
+
+static void test_sums(void)
+{
+	uint64_t sum = 0, sumsq = 0;
+	uint16_t val;
+	char expect[256];
+	uint32_t i;
+
+	stats_window(0);
+	for (i = 0; i < 60000; i++) {
+		val = 65535 - (i % 7) * 1000;
+		sum += val;
+		sumsq += (uint64_t)val * val;
+		stats_update(STATS_COUT, val);
+	}
+	stats_update(STATS_VIN, 12000);
+
+	report();
+	snprintf(expect, sizeof(expect), "0,0,0,0,0\r\n60000,59535,65535,%" PRIu64 ",%" PRIu64 "\r\n1,12000,12000,12000,144000000",
+			sum & 0xFFFFFFFF, sumsq);
+	check("sums and min/max", strcmp(out, expect) == 0);
+	check("sum of squares past 32 bits", sumsq > 0xFFFFFFFFULL * 4);
+
+	report();
+	check("query resets", strcmp(out, "0,0,0,0,0\r\n0,0,0,0,0\r\n0,0,0,0,0") == 0);
+}
+
+static void test_window(void)
+{
+	uint16_t i;
+
+	stats_window(4);
+	for (i = 1; i <= 10; i++)
+		stats_update(STATS_VOUT, i * 100);
+
+	report();
+	check("window holds the first samples", strncmp(out, "4,100,400,1000,300000\r\n", 23) == 0);
+
+	stats_update(STATS_VOUT, 5);
+	report();
+	check("window restarts after a query", strncmp(out, "1,5,5,5,25\r\n", 12) == 0);
+	stats_window(0);
+}
+
+int main()
+{
+	test_sums();
+	test_window();
+
+	return failed;
+}
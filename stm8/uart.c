@@ -17,16 +17,15 @@
  */
 
 #include "uart.h"
+#include "event.h"
 #include "fixedpoint.h"
 #include "stm8s.h"
 
-uint8_t uart_write_buf[255];
+uint8_t uart_write_buf[160]; // Room for the longest single answer, STATS? at 136 bytes
 uint8_t uart_write_start;
 uint8_t uart_write_len;
 
-uint8_t uart_read_buf[64];
-uint8_t uart_read_len;
-uint8_t read_newline;
+static uint16_t overruns;
 
 void parseinput(uint8_t c);
 
@@ -43,8 +42,6 @@ void uart_init()
 
 	uart_write_len = 0;
 	uart_write_start = 0;
-	uart_read_len = 0;
-	read_newline = 0;
 }
 
 inline uint8_t uart_write_ready(void)
@@ -52,23 +49,38 @@ inline uint8_t uart_write_ready(void)
 	return (USART1_SR & USART_SR_TXE);
 }
 
+// Move the buffer to the start
+static void uart_write_compact(void)
+{
+	uint8_t i;
+
+	if (uart_write_start > 0) {
+		for (i = 0; i < uart_write_len; i++) {
+			uart_write_buf[i] = uart_write_buf[i+uart_write_start];
+		}
+		uart_write_start = 0;
+	}
+}
+
 void uart_write_ch(const char ch)
 {
+	uart_write_compact();
+
 	if (uart_write_len < sizeof(uart_write_buf))
 		uart_write_buf[uart_write_len++] = ch;
 }
 
+// Bytes that can still be queued
+uint8_t uart_write_room(void)
+{
+	return sizeof(uart_write_buf) - uart_write_len;
+}
+
 void uart_write_str(const char *str)
 {
 	uint8_t i;
 
-	// Move the buffer to the start
-	if (uart_write_start > 0) {
-		for (i = 0; i < uart_write_len; i++) {
-			uart_write_buf[i] = uart_write_buf[i+uart_write_start];
-		}
-		uart_write_start = 0;
-	}
+	uart_write_compact();
 
 	for(i = 0; str[i] != 0 && uart_write_len < sizeof(uart_write_buf); i++) {
 		uart_write_buf[uart_write_len] = str[i];
@@ -137,20 +149,6 @@ void uart_write_int32(uint32_t val)
 	}
 }
 
-void uart_write_milliamp(uint16_t val)
-{
-	int8_t i;
-	uint8_t highest_nonzero;
-
-	highest_nonzero = int_to_digits(val);
-
-	for (i = highest_nonzero-1; i >= 0; i--) {
-		if (i == 2)
-			uart_write_ch('.');
-		uart_write_ch(digits_buf[i]);
-	}
-}
-
 void uart_write_millivolt(uint16_t val)
 {
 	int8_t i;
@@ -158,6 +156,10 @@ void uart_write_millivolt(uint16_t val)
 
 	highest_nonzero = int_to_digits(val);
 
+	// Always "<V>.<mmm>", the answer has no terminator and is framed by it
+	for (; highest_nonzero < 4; highest_nonzero++)
+		digits_buf[highest_nonzero] = '0';
+
 	for (i = highest_nonzero-1; i >= 0; i--) {
 		if (i == 2)
 			uart_write_ch('.');
@@ -165,33 +167,6 @@ void uart_write_millivolt(uint16_t val)
 	}
 }
 
-void uart_write_fixed_point(uint32_t val)
-{
-	uint32_t tmp;
-
-	// Print the integer part
-	tmp = val >> FIXED_SHIFT;
-	uart_write_int(tmp);
-	uart_write_ch('.');
-
-	// Remove the integer part
-	tmp = val & FIXED_FRACTION_MASK;
-
-	// Take three decimal digits from the fraction part
-	tmp = fixed_round(tmp*10000);
-
-	// Pad with zeros if the number is too small
-	if (tmp < 1000)
-		uart_write_ch('0');
-	if (tmp < 100)
-		uart_write_ch('0');
-	if (tmp < 10)
-		uart_write_ch('0');
-
-	// Write the remaining fractional part
-	uart_write_int32(tmp);
-}
-
 void uart_write_from_buf(void)
 {
 	USART1_DR = uart_write_buf[uart_write_start];
@@ -224,6 +199,11 @@ void uart_drive(void)
 {
 	uint8_t sr = USART1_SR;
 
+	// A byte came in before we read the last one, reading DR clears it
+	if (sr & USART_SR_OR) {
+		overruns++;
+		event_log(EVENT_UART_OVERRUN, overruns);
+	}
 	if (sr & USART_SR_RXNE) {
 		uart_read_to_buf();
 	}
@@ -18,17 +18,12 @@
 
 #include <stdint.h>
 
-extern uint8_t uart_read_buf[64];
-extern uint8_t uart_read_len;
-extern uint8_t read_newline;
-
 void uart_init(void);
 void uart_write_ch(const char ch);
 void uart_write_str(const char *str);
+uint8_t uart_write_room(void);
 void uart_write_int(uint16_t val);
 void uart_write_int32(uint32_t val);
-void uart_write_fixed_point(uint32_t val);
 void uart_write_millivolt(uint16_t val);
-void uart_write_milliamp(uint16_t val);
 void uart_drive(void);
 void uart_flush_writes(void);
@@ -0,0 +1,191 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ui.h"
+#include "buttons.h"
+#include "display.h"
+#include "config.h"
+#include "systick.h"
+#include "capabilities.h"
+
+extern cfg_system_t cfg_system;
+extern cfg_output_t cfg_output;
+void commit_output(void);
+
+/* Local control with the two buttons, button 1 is down and button 2 is up:
+ *
+ *  hold 1          edit vset, then press both to go on to cset and back out
+ *  hold 2          toggle the output
+ *  hold both       lock or unlock the buttons
+ *
+ * While editing, a press or auto repeat steps the setpoint by the resolution
+ * of the display and commits it right away. Editing ends after UI_TIMEOUT
+ * without a press, saving is left to the usual autosave.
+ */
+#define UI_IDLE 0
+#define UI_VSET 1
+#define UI_CSET 2
+#define UI_MESSAGE 3
+
+#define UI_TIMEOUT 4000 // msec
+#define UI_MESSAGE_TIME 1000 // msec
+
+#define VSTEP 100 // mV
+#define CSTEP 10 // mA
+
+#define BOTH ((1<<BUTTON_1) | (1<<BUTTON_2))
+
+static uint8_t ui_state;
+static uint8_t locked;
+static uint32_t ui_time;
+static uint16_t ui_undo; // Setpoint before the last step
+
+static void ui_show(void)
+{
+	if (ui_state == UI_VSET)
+		display_value(DISPLAY_VOUT, cfg_output.vset);
+	else
+		display_value(DISPLAY_IOUT, cfg_output.cset);
+	display_immediate();
+}
+
+static void ui_message(uint8_t lock)
+{
+	if (lock)
+		display_show_raw_digits(0x1C, 0x3A, 0x1A, 0); // "Loc"
+	else
+		display_show_raw_digits(0x8E, 0x0A, 0x9E, 0x9E); // "FrEE"
+	display_immediate();
+	ui_state = UI_MESSAGE;
+}
+
+static void ui_leave(void)
+{
+	ui_state = UI_IDLE;
+	display_invalidate();
+}
+
+static void ui_step(uint8_t up)
+{
+	uint16_t set = (ui_state == UI_VSET) ? cfg_output.vset : cfg_output.cset;
+	uint16_t step = (ui_state == UI_VSET) ? VSTEP : CSTEP;
+	uint16_t min = (ui_state == UI_VSET) ? CAP_VMIN : CAP_CMIN;
+	uint16_t max = (ui_state == UI_VSET) ? CAP_VMAX : CAP_CMAX;
+
+	ui_undo = set;
+
+	if (up)
+		set = (set <= max - step) ? set + step : max;
+	else
+		set = (set >= min + step) ? set - step : min;
+
+	// By value, the config is packed and its members may be unaligned
+	if (ui_state == UI_VSET)
+		cfg_output.vset = set;
+	else
+		cfg_output.cset = set;
+
+	commit_output();
+	ui_show();
+}
+
+static void ui_event(uint8_t event)
+{
+	uint8_t button = BUTTON_OF(event);
+	uint8_t type = BUTTON_TYPE(event);
+	uint8_t down = buttons_down();
+
+	if (type == BUTTON_LONG && button == BUTTON_2 && down == BOTH) {
+		locked = !locked;
+		ui_message(locked);
+		return;
+	}
+
+	if (locked)
+		return;
+
+	switch (ui_state) {
+		case UI_IDLE:
+			if (type != BUTTON_LONG || down == BOTH)
+				break;
+
+			if (button == BUTTON_1) {
+				ui_state = UI_VSET;
+				ui_undo = cfg_output.vset;
+				ui_show();
+			} else {
+				cfg_system.output = !cfg_system.output;
+				commit_output();
+			}
+			break;
+
+		case UI_VSET:
+		case UI_CSET:
+			if (type == BUTTON_PRESS && down == BOTH) {
+				// The first of the two presses already stepped, take it back
+				if (ui_state == UI_VSET)
+					cfg_output.vset = ui_undo;
+				else
+					cfg_output.cset = ui_undo;
+				commit_output();
+
+				if (ui_state == UI_VSET) {
+					ui_state = UI_CSET;
+					ui_undo = cfg_output.cset;
+					ui_show();
+				} else {
+					ui_leave();
+				}
+			} else if ((type == BUTTON_PRESS || type == BUTTON_REPEAT) && down != BOTH) {
+				ui_step(button == BUTTON_2);
+			}
+			break;
+	}
+}
+
+// Called from the main loop, handles at most one event per call
+void ui_update(void)
+{
+	uint8_t event = buttons_event();
+	uint32_t now = systick_now();
+
+	if (event) {
+		display_wake();
+		ui_time = now;
+		ui_event(event);
+		return;
+	}
+
+	if (ui_state != UI_IDLE) {
+		uint16_t timeout = (ui_state == UI_MESSAGE) ? UI_MESSAGE_TIME : UI_TIMEOUT;
+
+		if (now - ui_time >= timeout)
+			ui_leave();
+	}
+}
+
+// The UI owns the display
+uint8_t ui_active(void)
+{
+	return ui_state != UI_IDLE;
+}
+
+uint8_t ui_locked(void)
+{
+	return locked;
+}
@@ -0,0 +1,34 @@
+/* Copyright (C) 2020 Kristian Wiklund
+ *
+ * This file is part of the B3603 alternative firmware.
+ *
+ *  B3603 alternative firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  B3603 alternative firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with B3603 alternative firmware.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UI_H
+#define UI_H
+
+#include <stdint.h>
+
+#if FEATURE_UI
+void ui_update(void);
+uint8_t ui_active(void);
+uint8_t ui_locked(void);
+#else
+// Built without the buttons, see FEATURES in the Makefile
+#define ui_update()
+#define ui_active() 0
+#endif
+
+#endif
@@ -0,0 +1,237 @@
+#!/usr/bin/python
+
+# Firmware upload through the resident bootloader, see boot/boot.c. The running
+# firmware is sent BOOT to reset into the bootloader, then the image goes over
+# in blocks with a CRC each, is checked as a whole and started.
+#
+#   upload.py [-p port] [-n] b3603-app.ihx
+#   upload.py -B boot/boot.ihx -o b3603-full.ihx b3603-app.ihx
+#
+# The second form writes one hex file with the bootloader, the image and its
+# descriptor for the first flashing with the ST-Link.
+
+import sys
+import time
+import getopt
+import serial
+
+# From boot/boot.h
+BOOT_START = 0x8000
+BOOT_APP_START = 0x8400
+BOOT_INFO = 0x9FC0
+BOOT_APP_SIZE = BOOT_INFO - BOOT_APP_START
+BOOT_BLOCK = 64
+BOOT_SYNC = 0x7F
+BOOT_ACK = 0x79
+BOOT_NACK = 0x1F
+
+FIRMWARE_BAUD = 38400
+BOOT_BAUD = 115200
+RETRIES = 5
+
+class BootError(Exception):
+    pass
+
+def crc16(data, crc=0xFFFF):
+    for b in bytearray(data):
+        crc ^= b << 8
+        for i in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+            else:
+                crc = (crc << 1) & 0xFFFF
+    return crc
+
+def be16(val):
+    return bytearray([(val >> 8) & 0xFF, val & 0xFF])
+
+def read_hex(name):
+    mem = {}
+    upper = 0
+    for line in open(name):
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        rec = bytearray(line[1:].decode('hex'))
+        if sum(rec) & 0xFF:
+            raise BootError('%s: bad checksum in "%s"' % (name, line))
+        count, addr, kind = rec[0], (rec[1] << 8) | rec[2], rec[3]
+        data = rec[4:4 + count]
+        if kind == 0:
+            for i, b in enumerate(data):
+                mem[upper + addr + i] = b
+        elif kind == 1:
+            break
+        elif kind == 4:
+            upper = ((data[0] << 8) | data[1]) << 16
+    return mem
+
+def write_hex(name, mem):
+    out = open(name, 'w')
+    addrs = sorted(mem)
+    i = 0
+    while i < len(addrs):
+        start = addrs[i]
+        data = bytearray()
+        while i < len(addrs) and addrs[i] == start + len(data) and len(data) < 16:
+            data.append(mem[addrs[i]])
+            i += 1
+        rec = bytearray([len(data), (start >> 8) & 0xFF, start & 0xFF, 0]) + data
+        rec.append(-sum(rec) & 0xFF)
+        out.write(':%s\n' % str(rec).encode('hex').upper())
+    out.write(':00000001FF\n')
+    out.close()
+
+def read_image(name):
+    """The image from BOOT_APP_START on, padded to whole words"""
+    if name.endswith('.bin'):
+        image = bytearray(open(name, 'rb').read())
+    else:
+        mem = read_hex(name)
+        if not mem:
+            raise BootError('%s is empty' % name)
+        if min(mem) < BOOT_APP_START:
+            raise BootError('%s starts at 0x%04X, it is not linked for the bootloader (make boot)' % (name, min(mem)))
+        image = bytearray(max(mem) + 1 - BOOT_APP_START) # Erased flash reads 0
+        for addr, b in mem.items():
+            image[addr - BOOT_APP_START] = b
+    image += bytearray(-len(image) % 4)
+    if len(image) > BOOT_APP_SIZE:
+        raise BootError('the image is %d bytes, only %d fit' % (len(image), BOOT_APP_SIZE))
+    return image
+
+def descriptor(image):
+    return be16(len(image)) + be16(crc16(image)) + bytearray('B360')
+
+class Bootloader(object):
+    def __init__(self, portname):
+        self.s = serial.Serial(portname, baudrate=FIRMWARE_BAUD, timeout=0.05)
+
+    def close(self):
+        self.s.close()
+
+    def drain(self):
+        while self.s.read(64) != '':
+            pass
+
+    def enter(self, reset=True, wait=3.0):
+        """Resets the running firmware into the bootloader unless reset is
+        False, then catches its start up window"""
+        if reset:
+            self.s.write('BOOT')
+            self.s.flush()
+        self.s.baudrate = BOOT_BAUD
+        end = time.time() + wait
+        while time.time() < end:
+            self.s.write(chr(BOOT_SYNC))
+            if self.s.read(1) == chr(BOOT_ACK):
+                self.drain() # The answers to the other syncs
+                return
+        raise BootError('no answer from the bootloader')
+
+    def command(self, data, timeout=1.0):
+        """Sends a command and returns True for an ACK, False for a NACK"""
+        self.s.write(str(data))
+        end = time.time() + timeout
+        while time.time() < end:
+            c = self.s.read(1)
+            if c == chr(BOOT_ACK):
+                return True
+            if c == chr(BOOT_NACK):
+                return False
+        raise BootError('no answer to command %r' % chr(data[0]))
+
+    def retry(self, what, data):
+        for i in range(RETRIES):
+            try:
+                if self.command(data):
+                    return
+            except BootError:
+                pass
+            # Lost track of the framing, the bootloader drops a half frame
+            # after 100 msec without input
+            time.sleep(0.2)
+            self.drain()
+        raise BootError('%s failed' % what)
+
+    def erase(self):
+        self.retry('erase', bytearray('E'))
+
+    def write(self, offset, data):
+        frame = be16(offset) + bytearray([len(data)]) + data
+        self.retry('write at %d' % offset, bytearray('W') + frame + be16(crc16(frame)))
+
+    def verify(self, image):
+        frame = be16(len(image)) + be16(crc16(image))
+        return self.command(bytearray('V') + frame + be16(crc16(frame)), timeout=3.0)
+
+    def go(self):
+        return self.command(bytearray('G'), timeout=3.0)
+
+    def upload(self, image, log=None):
+        self.erase()
+        for offset in range(0, len(image), BOOT_BLOCK):
+            self.write(offset, image[offset:offset + BOOT_BLOCK])
+            if log:
+                log('\r%d/%d bytes' % (min(offset + BOOT_BLOCK, len(image)), len(image)))
+        if log:
+            log('\n')
+        if not self.verify(image):
+            raise BootError('the image CRC does not match, it was not started')
+        if not self.go():
+            raise BootError('the bootloader did not start the image')
+
+def usage():
+    print 'usage: %s [-p port] [-n] <image.ihx|image.bin>' % sys.argv[0]
+    print '       %s -B <boot.ihx> -o <out.ihx> <image.ihx>' % sys.argv[0]
+    print '  -n  the unit is already in the bootloader, do not send BOOT'
+    return 2
+
+def main():
+    port = '/dev/ttyUSB0'
+    reset = True
+    boot = None
+    output = None
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'p:nB:o:')
+    except getopt.GetoptError:
+        return usage()
+    for opt, val in opts:
+        if opt == '-p':
+            port = val
+        elif opt == '-n':
+            reset = False
+        elif opt == '-B':
+            boot = val
+        elif opt == '-o':
+            output = val
+    if len(args) != 1 or (boot is None) != (output is None):
+        return usage()
+
+    try:
+        image = read_image(args[0])
+
+        if output:
+            mem = read_hex(boot)
+            if max(mem) >= BOOT_APP_START:
+                raise BootError('%s does not fit before 0x%04X' % (boot, BOOT_APP_START))
+            for i, b in enumerate(image):
+                mem[BOOT_APP_START + i] = b
+            for i, b in enumerate(descriptor(image)):
+                mem[BOOT_INFO + i] = b
+            write_hex(output, mem)
+            return 0
+
+        bl = Bootloader(port)
+        bl.enter(reset)
+        bl.upload(image, sys.stdout.write)
+        bl.close()
+        print 'Started %d bytes, CRC %04X' % (len(image), crc16(image))
+    except (BootError, IOError, serial.SerialException) as e:
+        print 'error:', e
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())